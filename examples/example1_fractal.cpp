@@ -1,10 +1,15 @@
-#include <img/Image.h>
+#include <img/PngWriter.h>
 
 using namespace img;
 
 int main()
 {
-    ImageRGBf image(610,1080);
+    constexpr auto height = 610;
+    constexpr auto width  = 1080;
+
+    // rows are written as they are computed, the whole image is never held
+    PngWriter writer("example1_fractal.png", height, width, 3);
+    ImageRGBf row(1,width);
 
     const auto black = ImageRGBf::Color(0,0,0);
     const auto green = ImageRGBf::Color(0,1,0);
@@ -12,12 +17,12 @@ int main()
 
     constexpr auto max_iteration = 100;
 
-    for(int i=0; i<image.height(); ++i)
+    for(int i=0; i<height; ++i)
     {
-        for(int j=0; j<image.width(); ++j)
+        for(int j=0; j<width; ++j)
         {
-            const auto x0 = float(j)/(image.width()-1)  * 3.5f - 2.5f;
-            const auto y0 = float(i)/(image.height()-1) * 2.0f - 1.0f;
+            const auto x0 = float(j)/(width-1)  * 3.5f - 2.5f;
+            const auto y0 = float(i)/(height-1) * 2.0f - 1.0f;
             auto x = 0.f;
             auto y = 0.f;
             auto iteration = 0;
@@ -30,17 +35,20 @@ int main()
             }
             if(iteration == max_iteration)
             {
-                image(i,j) = white;
+                row(0,j) = white;
             }
             else
             {
                 const auto t = float(iteration)/max_iteration;
-                image(i,j) = (1.f-t)*black + t*green;
+                row(0,j) = (1.f-t)*black + t*green;
             }
         }
+        // a failed write leaves the file unusable
+        if(!writer.write(row))
+            return 1;
     }
 
     // save image
-    const bool ok = save("example1_fractal.png", image);
+    const bool ok = writer.close();
     return !ok;
 }
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <img/Image.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+
+#ifndef IMG_NO_THREADS
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+namespace img {
+
+// async -----------------------------------------------------------------------
+
+//!
+//! \brief Outcome of load_async()
+//!
+template<typename T, int C>
+struct LoadResult
+{
+    Image<T,C>  image; //!< \brief empty if the load failed
+    bool        ok = false;
+    std::string error; //!< \brief failure reason if the load failed
+};
+
+//!
+//! \brief Dedicated I/O threads running load() and save() in the background
+//!
+//! Images to save are taken by value: pass std::move(image) to hand it over,
+//! or the image itself to save a snapshot of it. Their memory counts against
+//! max_bytes() from the call until the file is written, and a call that would
+//! exceed it blocks until enough earlier saves are done, so a slow disk holds
+//! back the producer instead of exhausting memory. A single image larger than
+//! max_bytes() is still queued once nothing else is. Loads hold no memory until
+//! decoded, then their image belongs to the caller.
+//!
+//! Jobs start in the order they are queued. Completion callbacks run on an I/O
+//! thread and must not throw, they may queue other jobs without blocking.
+//! The destructor waits for all queued jobs. With IMG_NO_THREADS, jobs run in
+//! the calling thread before the call returns.
+//!
+class IoQueue
+{
+public:
+    //! \param threads number of I/O threads, at least 1
+    //! \param max_bytes maximal number of bytes of images queued to be saved
+    inline explicit IoQueue(int threads = 1,
+                            std::size_t max_bytes = std::size_t(1) << 30);
+    inline ~IoQueue();
+
+    IoQueue(const IoQueue&) = delete;
+    IoQueue& operator=(const IoQueue&) = delete;
+
+    //! \brief shared queue of load_async() and save_async(), with one thread
+    static inline IoQueue& instance();
+
+public:
+    template<typename T, int C>
+    inline std::future<bool> save(const std::string& filename,
+                                  Image<T,C> image,
+                                  const SaveOptions& options = SaveOptions());
+
+    //! \brief save() calling done(ok) once the file is written
+    template<typename T, int C>
+    inline void save(const std::string& filename,
+                     Image<T,C> image,
+                     const SaveOptions& options,
+                     std::function<void(bool)> done);
+
+    template<typename T, int C>
+    inline std::future<LoadResult<T,C>> load(const std::string& filename,
+                                             const LoadOptions& options = LoadOptions());
+
+    //! \brief load() calling done(LoadResult&&) once the file is decoded
+    template<typename T, int C>
+    inline void load(const std::string& filename,
+                     const LoadOptions& options,
+                     std::function<void(LoadResult<T,C>&&)> done);
+
+    //! \brief Block until all queued jobs are done
+    inline void wait();
+
+    inline std::size_t queued_bytes() const;
+    inline std::size_t max_bytes() const;
+
+protected:
+    //! \brief Queue job, holding bytes until it is done
+    inline void push(std::size_t bytes, std::function<void()> job);
+    inline void run();
+
+protected:
+    struct Job
+    {
+        std::size_t           bytes;
+        std::function<void()> run;
+    };
+
+    std::size_t                 m_max_bytes;
+#ifndef IMG_NO_THREADS
+    std::vector<std::thread>    m_threads;
+    std::deque<Job>             m_jobs;
+    mutable std::mutex          m_mutex;
+    std::condition_variable     m_queued;   // a job was queued
+    std::condition_variable     m_released; // a job is done
+    std::size_t                 m_bytes   = 0;
+    int                         m_running = 0;
+    bool                        m_stop    = false;
+#endif
+};
+
+//! \brief Save image in the background on IoQueue::instance()
+template<typename T, int C>
+inline std::future<bool> save_async(const std::string& filename,
+                                    Image<T,C> image,
+                                    const SaveOptions& options = SaveOptions());
+
+//! \brief Load a file in the background on IoQueue::instance()
+template<typename T, int C>
+inline std::future<LoadResult<T,C>> load_async(const std::string& filename,
+                                               const LoadOptions& options = LoadOptions());
+
+// -----------------------------------------------------------------------------
+
+namespace internal {
+
+//! \brief IoQueue whose thread is the calling one, if any
+inline const IoQueue*& io_worker()
+{
+    static thread_local const IoQueue* queue = nullptr;
+    return queue;
+}
+
+template<typename T, int C>
+inline LoadResult<T,C> load_result(const std::string& filename, const LoadOptions& options)
+{
+    LoadResult<T,C> result;
+    result.ok = load(filename, result.image, options);
+    if(!result.ok)
+        result.error = failure_reason();
+    return result;
+}
+
+} // namespace internal
+
+IoQueue::IoQueue(int threads, std::size_t max_bytes) :
+    m_max_bytes(max_bytes)
+{
+#ifdef IMG_NO_THREADS
+    (void)threads;
+#else
+    for(int i = 0; i < std::max(1, threads); ++i)
+        m_threads.emplace_back([this](){this->run();});
+#endif
+}
+
+IoQueue::~IoQueue()
+{
+#ifndef IMG_NO_THREADS
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_queued.notify_all();
+    for(auto& thread : m_threads)
+        thread.join();
+#endif
+}
+
+IoQueue& IoQueue::instance()
+{
+    static IoQueue queue;
+    return queue;
+}
+
+template<typename T, int C>
+std::future<bool> IoQueue::save(const std::string& filename, Image<T,C> image, const SaveOptions& options)
+{
+    // std::function needs a copyable job
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto future  = promise->get_future();
+    save(filename, std::move(image), options, [promise](bool ok){promise->set_value(ok);});
+    return future;
+}
+
+template<typename T, int C>
+void IoQueue::save(const std::string& filename,
+                   Image<T,C> image,
+                   const SaveOptions& options,
+                   std::function<void(bool)> done)
+{
+    const auto bytes = std::size_t(image.size()) * C * sizeof(T);
+    auto shared = std::make_shared<Image<T,C>>(std::move(image));
+    push(bytes, [filename, shared, options, done]() mutable
+    {
+        bool ok = false;
+        try
+        {
+            ok = img::save(filename, *shared, options);
+        }
+        catch(...)
+        {
+        }
+        // the image is released before the caller is told
+        shared.reset();
+        if(done) done(ok);
+    });
+}
+
+template<typename T, int C>
+std::future<LoadResult<T,C>> IoQueue::load(const std::string& filename, const LoadOptions& options)
+{
+    auto promise = std::make_shared<std::promise<LoadResult<T,C>>>();
+    auto future  = promise->get_future();
+    push(0, [filename, options, promise]()
+    {
+        try
+        {
+            promise->set_value(internal::load_result<T,C>(filename, options));
+        }
+        catch(...)
+        {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return future;
+}
+
+template<typename T, int C>
+void IoQueue::load(const std::string& filename,
+                   const LoadOptions& options,
+                   std::function<void(LoadResult<T,C>&&)> done)
+{
+    push(0, [filename, options, done]()
+    {
+        LoadResult<T,C> result;
+        try
+        {
+            result = internal::load_result<T,C>(filename, options);
+        }
+        catch(...)
+        {
+            result = LoadResult<T,C>();
+            result.error = "out of memory";
+        }
+        if(done) done(std::move(result));
+    });
+}
+
+void IoQueue::wait()
+{
+#ifndef IMG_NO_THREADS
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_released.wait(lock, [this](){return m_jobs.empty() && m_running == 0;});
+#endif
+}
+
+std::size_t IoQueue::queued_bytes() const
+{
+#ifdef IMG_NO_THREADS
+    return 0;
+#else
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+#endif
+}
+
+std::size_t IoQueue::max_bytes() const
+{
+    return m_max_bytes;
+}
+
+void IoQueue::push(std::size_t bytes, std::function<void()> job)
+{
+#ifdef IMG_NO_THREADS
+    (void)bytes;
+    job();
+#else
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // a job queued by a callback cannot wait for its own thread
+        if(internal::io_worker() != this)
+            m_released.wait(lock, [&](){return m_bytes == 0 || m_bytes + bytes <= m_max_bytes;});
+        m_bytes += bytes;
+        m_jobs.push_back(Job{bytes, std::move(job)});
+    }
+    m_queued.notify_one();
+#endif
+}
+
+void IoQueue::run()
+{
+#ifndef IMG_NO_THREADS
+    internal::io_worker() = this;
+    for(;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_queued.wait(lock, [this](){return m_stop || !m_jobs.empty();});
+            if(m_stop && m_jobs.empty()) return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            ++m_running;
+        }
+        job.run();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_bytes -= job.bytes;
+            --m_running;
+        }
+        m_released.notify_all();
+    }
+#endif
+}
+
+template<typename T, int C>
+std::future<bool> save_async(const std::string& filename, Image<T,C> image, const SaveOptions& options)
+{
+    return IoQueue::instance().save(filename, std::move(image), options);
+}
+
+template<typename T, int C>
+std::future<LoadResult<T,C>> load_async(const std::string& filename, const LoadOptions& options)
+{
+    return IoQueue::instance().load<T,C>(filename, options);
+}
+
+} // namespace img
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <img/Image.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifndef IMG_NO_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace img {
+
+// batch -----------------------------------------------------------------------
+
+//!
+//! \brief Outcome of the load of one file of load_batch()
+//!
+template<typename T, int C>
+struct BatchResult
+{
+    std::size_t index; //!< \brief position of the file in the list of paths
+    std::string path;
+    Image<T,C>  image; //!< \brief empty if the load failed
+    bool        ok;
+    std::string error; //!< \brief failure reason if the load failed
+};
+
+//!
+//! \brief Options of load_batch()
+//!
+struct BatchOptions
+{
+    LoadOptions load;
+
+    //! \brief number of decoding threads, 0 for one per hardware thread
+    int threads = 0;
+
+    //! \brief maximal number of bytes held by images decoded or being decoded
+    //! but not yet delivered, a single image larger than this still gets loaded
+    std::size_t max_bytes = std::size_t(1) << 30;
+};
+
+//!
+//! \brief Load all files of paths in parallel and call callback(BatchResult&&)
+//! for each of them, in completion order
+//!
+//! The callback is always called from the calling thread, one result at a time,
+//! and load_batch() returns once all files are delivered. The memory of an
+//! image counts against BatchOptions::max_bytes from the start of its decoding
+//! until its callback returns, so a slow callback holds back the decoders.
+//! Failures are reported through BatchResult::ok and do not stop the batch.
+//! The first exception thrown by the callback is rethrown after the workers
+//! are stopped.
+//!
+//! \return the number of files successfully loaded
+//!
+template<typename T, int C, class Callback>
+inline std::size_t load_batch(const std::vector<std::string>& paths,
+                              Callback&& callback,
+                              const BatchOptions& options = BatchOptions());
+
+// probe -----------------------------------------------------------------------
+
+//!
+//! \brief Header of one file of probe_batch()
+//!
+struct ProbeResult
+{
+    std::string path;
+    ImageInfo   info;
+    bool        ok;
+    std::string error; //!< \brief failure reason if the header could not be read
+};
+
+//!
+//! \brief Read the headers of all files of paths in parallel with info(),
+//! without decoding their image data
+//!
+//! \param threads number of threads, 0 for one per hardware thread
+//! \return the results in the order of paths
+//!
+inline std::vector<ProbeResult> probe_batch(const std::vector<std::string>& paths,
+                                            int threads = 0);
+
+//!
+//! \brief probe_batch() for the regular files of directory with an extension
+//! read by info() (png, pnm, pgm, ppm, pfm, qoi), in any case, sorted by path
+//!
+//! \return no result if directory cannot be listed
+//!
+inline std::vector<ProbeResult> probe_directory(const std::string& directory,
+                                                int threads = 0);
+
+// -----------------------------------------------------------------------------
+
+namespace internal {
+
+//! \brief bytes held while decoding the file into Image<T,C>, 0 if unknown
+template<typename T, int C>
+inline std::size_t load_bytes(const std::string& path)
+{
+    ImageInfo image_info;
+    if(!info(path, image_info))
+        return 0;
+    // decoded bytes of stb plus the converted image
+    const auto pixels = std::size_t(image_info.width) * std::size_t(image_info.height);
+    const auto bytes  = std::size_t(image_info.bits / 8);
+    return pixels * std::size_t(std::max(image_info.channels, C)) * bytes + pixels * C * sizeof(T);
+}
+
+template<typename T, int C>
+inline BatchResult<T,C> load_one(const std::vector<std::string>& paths,
+                                 std::size_t index,
+                                 const LoadOptions& options)
+{
+    BatchResult<T,C> result;
+    result.index = index;
+    result.path  = paths[index];
+    try
+    {
+        result.ok = load(result.path, result.image, options);
+        if(!result.ok)
+            result.error = failure_reason();
+    }
+    catch(...)
+    {
+        // an exception would terminate the worker thread
+        result.image = Image<T,C>();
+        result.ok    = false;
+        result.error = "out of memory";
+    }
+    return result;
+}
+
+} // namespace internal
+
+template<typename T, int C, class Callback>
+std::size_t load_batch(const std::vector<std::string>& paths,
+                       Callback&& callback,
+                       const BatchOptions& options)
+{
+    std::size_t loaded = 0;
+
+#ifdef IMG_NO_THREADS
+    for(std::size_t i = 0; i < paths.size(); ++i)
+    {
+        auto result = internal::load_one<T,C>(paths, i, options.load);
+        loaded += result.ok;
+        callback(std::move(result));
+    }
+#else
+    const int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+    const int count    = int(std::min<std::size_t>(paths.size(),
+                             options.threads > 0 ? options.threads : hardware));
+
+    struct Done {
+        BatchResult<T,C> result;
+        std::size_t      bytes;
+    };
+
+    std::mutex              mutex;
+    std::condition_variable decoded;   // a result is ready
+    std::condition_variable released;  // bytes were released
+    std::deque<Done>        done;
+    std::size_t             next      = 0;
+    std::size_t             in_flight = 0;
+    bool                    stop      = false;
+
+    const auto work = [&]()
+    {
+        for(;;)
+        {
+            std::size_t index = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(stop || next == paths.size()) return;
+                index = next++;
+            }
+
+            const auto bytes = internal::load_bytes<T,C>(paths[index]);
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                released.wait(lock, [&](){
+                    return stop || in_flight == 0 ||
+                           in_flight + bytes <= options.max_bytes;});
+                if(stop) return;
+                in_flight += bytes;
+            }
+
+            auto result = internal::load_one<T,C>(paths, index, options.load);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.push_back(Done{std::move(result), bytes});
+            }
+            decoded.notify_one();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < count; ++i)
+        threads.emplace_back(work);
+
+    std::exception_ptr error;
+    for(std::size_t delivered = 0; delivered < paths.size(); ++delivered)
+    {
+        Done item;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            decoded.wait(lock, [&](){return !done.empty();});
+            item = std::move(done.front());
+            done.pop_front();
+        }
+        loaded += item.result.ok;
+        try
+        {
+            callback(std::move(item.result));
+        }
+        catch(...)
+        {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            in_flight -= item.bytes;
+            stop = bool(error);
+        }
+        released.notify_all();
+        if(error) break;
+    }
+
+    for(auto& thread : threads)
+        thread.join();
+    if(error)
+        std::rethrow_exception(error);
+#endif
+
+    return loaded;
+}
+
+std::vector<ProbeResult> probe_batch(const std::vector<std::string>& paths, int threads)
+{
+    std::vector<ProbeResult> results(paths.size());
+    const auto probe = [&](std::size_t index)
+    {
+        auto& result = results[index];
+        result.path = paths[index];
+        result.ok   = info(result.path, result.info);
+        if(!result.ok)
+            result.error = failure_reason();
+    };
+
+#ifdef IMG_NO_THREADS
+    (void)threads;
+    for(std::size_t i = 0; i < paths.size(); ++i)
+        probe(i);
+#else
+    const int hardware = std::max(1, int(std::thread::hardware_concurrency()));
+    const int count    = int(std::min<std::size_t>(paths.size(),
+                             threads > 0 ? threads : hardware));
+
+    // headers are tiny, the threads only hide the latency of the reads
+    std::atomic<std::size_t> next{0};
+    const auto work = [&]()
+    {
+        for(auto index = next++; index < paths.size(); index = next++)
+            probe(index);
+    };
+
+    std::vector<std::thread> workers;
+    for(int i = 1; i < count; ++i)
+        workers.emplace_back(work);
+    work();
+    for(auto& worker : workers)
+        worker.join();
+#endif
+
+    return results;
+}
+
+std::vector<ProbeResult> probe_directory(const std::string& directory, int threads)
+{
+    std::vector<std::string> paths;
+    std::error_code error;
+    for(std::filesystem::directory_iterator it(directory, error), end;
+        !error && it != end;
+        it.increment(error))
+    {
+        std::error_code ignored;
+        if(!it->is_regular_file(ignored))
+            continue;
+        // file_format() falls back to png, so .png is the only one to match
+        auto path      = it->path().string();
+        auto extension = it->path().extension().string();
+        for(auto& c : extension)
+            c = char(std::tolower(static_cast<unsigned char>(c)));
+        if(extension == ".png" || internal::file_format(path) != internal::FileFormat::png)
+            paths.push_back(std::move(path));
+    }
+    std::sort(paths.begin(), paths.end());
+    return probe_batch(paths, threads);
+}
+
+} // namespace img
@@ -9,6 +9,22 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#ifndef IMG_NO_THREADS
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#endif
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -19,6 +35,29 @@
 #include <assert.h>
 #include <cmath>
 
+// files are decoded from a read-only mapping when possible
+#if !defined(IMG_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define IMG_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SSE2 kernels are used whenever the target has SSE2, AVX2 and PCLMUL kernels
+// are compiled separately and selected at runtime (GCC and Clang only)
+#if !defined(IMG_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define IMG_SSE2
+#include <emmintrin.h>
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define IMG_AVX2
+#define IMG_TARGET_AVX2 __attribute__((target("avx2")))
+#define IMG_TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#include <immintrin.h>
+#endif
+#endif
+
 namespace img {
 
 template<typename T = float, int C = 4>
@@ -47,16 +86,99 @@ inline void cast(const Image<TFrom, CFrom>& from, Image<TTo, CTo>& to);
 
 // io --------------------------------------------------------------------------
 
+//! \brief Options of a single load(), no state is shared between calls
+struct LoadOptions
+{
+    bool flip          = false; //!< \brief first row of the image is the last one of the file
+    bool unpremultiply = false; //!< \brief undo premultiplied alpha of iPhone PNGs (with de_iphone)
+    bool de_iphone     = false; //!< \brief convert iPhone PNGs from BGR to RGB
+    bool verify        = false; //!< \brief check the CRC-32 of the image data chunks and the Adler-32 of the image data
+};
+
+//! \brief Options of a single save(), no state is shared between calls
+struct SaveOptions
+{
+    bool flip              = false; //!< \brief last row of the image is the first one of the file
+    int  compression_level = 6;     //!< \brief from 1 (fastest) to 9 (smallest), 0 stores the rows uncompressed
+    int  filter            = -1;    //!< \brief PNG filter of all rows (0 to 4), -1 picks one per row
+    int  bits              = 8;     //!< \brief bits per channel, 8 or 16
+    bool parallel          = true;  //!< \brief compress large images by chunks on the shared thread pool
+    bool qoi               = false; //!< \brief encode() produces a QOI file instead of a PNG file
+};
+
+//!
+//! \brief Load a PNG file, or a binary PGM/PPM (8 or 16 bits), PFM or QOI file
+//! when filename ends with .pgm, .ppm, .pnm, .pfm or .qoi
+//!
 template<typename T, int C>
 inline bool load(const std::string& filename,
                  Image<T,C>& image,
                  bool flip = false);
 
+template<typename T, int C>
+inline bool load(const std::string& filename,
+                 Image<T,C>& image,
+                 const LoadOptions& options);
+
+//!
+//! \brief Save a PNG file, or a file of the format given by the extension of
+//! filename: .pgm (gray), .ppm (RGB), .pnm (gray or RGB) of SaveOptions::bits
+//! bits, .pfm (gray or RGB 32-bit floats) or .qoi (RGB or RGBA)
+//!
+//! Channels are converted as by cast() when the format does not have the ones
+//! of the image, the other options only apply to PNG files.
+//!
 template<typename T, int C>
 inline bool save(const std::string& filename,
                  const Image<T,C>& image,
                  bool flip = false);
 
+template<typename T, int C>
+inline bool save(const std::string& filename,
+                 const Image<T,C>& image,
+                 const SaveOptions& options);
+
+//! \brief Load a PNG or QOI file held in memory
+template<typename T, int C>
+inline bool decode(const void* data,
+                   std::size_t size,
+                   Image<T,C>& image,
+                   const LoadOptions& options = LoadOptions());
+
+//! \brief Encode a PNG file, or a QOI file with SaveOptions::qoi, in memory,
+//! empty on failure
+template<typename T, int C>
+inline std::vector<std::uint8_t> encode(const Image<T,C>& image,
+                                        const SaveOptions& options = SaveOptions());
+
+//! \brief Encode a PNG file passed to sink(data,size) piece by piece, as it is
+//! produced, or a QOI file passed whole
+//! \warning sink must not throw
+template<typename T, int C>
+inline bool encode(const Image<T,C>& image,
+                   const std::function<void(const void*, std::size_t)>& sink,
+                   const SaveOptions& options = SaveOptions());
+
+//! \brief Dimensions and format of an image file
+struct ImageInfo
+{
+    int height   = 0;
+    int width    = 0;
+    int channels = 0; //!< \brief channels of the file, 3 or 4 for palettes (4 with a tRNS chunk)
+    int bits     = 0; //!< \brief bits per channel of the decoded pixels, 8 or 16, 32 for PFM files
+};
+
+//! \brief Read the dimensions and format of a PNG file, or of a file of one of
+//! the formats of load(), from its header, without decoding its image data
+inline bool info(const std::string& filename, ImageInfo& image_info);
+
+//! \brief info() for a PNG or QOI file held in memory
+inline bool info(const void* data, std::size_t size, ImageInfo& image_info);
+
+//! \brief Reason of the last load(), decode() or info() that failed on the
+//! calling thread
+inline const char* failure_reason();
+
 // details ---------------------------------------------------------------------
 
 #ifdef IMG_NO_EIGEN
@@ -288,6 +410,15 @@ template<> inline char   cast_channel(int val)    {return char(val);}
 template<> inline char   cast_channel(float val)  {return char(int(std::round(255.f * val)));}
 template<> inline char   cast_channel(double val) {return char(int(std::round(255.  * val)));}
 
+// 16-bit values of PNG files
+template<> inline int    cast_channel(unsigned short val) {return (255 * int(val) + 32767) / 65535;}
+template<> inline float  cast_channel(unsigned short val) {return float(val)  / 65535.f;}
+template<> inline double cast_channel(unsigned short val) {return double(val) / 65535.;}
+
+template<> inline unsigned short cast_channel(int val)    {return (unsigned short)(257 * val);}
+template<> inline unsigned short cast_channel(float val)  {return (unsigned short)(int(std::round(65535.f * val)));}
+template<> inline unsigned short cast_channel(double val) {return (unsigned short)(int(std::round(65535.  * val)));}
+
 // use struct since partial specialization are not allowed for functions
 template<typename TFrom, typename TTo> struct Average {
     static TTo compute(TFrom r, TFrom g, TFrom b) {
@@ -304,7 +435,7 @@ template<typename TFrom> struct Average<TFrom,int> {
 
 template<typename TTo> struct Average<int,TTo> {
     static TTo compute(int r, int g, int b) {
-        return double(r + g + b) / 3. / 255.;
+        return TTo(r + g + b) / TTo(3 * 255);
     }
 };
 
@@ -458,259 +589,2032 @@ template<typename TFrom, typename TTo> struct DefaultCaster<TFrom,4,TTo,4> {
     }
 };
 
-} // namespace internal
+// vectorized casts ------------------------------------------------------------
 
-// cast ------------------------------------------------------------------------
+namespace simd {
 
-template<typename TFrom, int CFrom, typename TTo, int CTo, class Caster>
-void cast(const Image<TFrom, CFrom>& from, Image<TTo, CTo>& to, Caster&& caster)
-{
-    to.resize(from.height(), from.width());
-    //TODO omp ?
-    for (int k = 0; k < from.size(); ++k)
-    {
-        to(k) = caster(from(k));
-    }
+template<typename T>
+constexpr bool is_vectorized() {
+    return std::is_same<T,int>::value || std::is_same<T,float>::value;
 }
 
-template<typename TFrom, int CFrom, typename TTo, int CTo>
-void cast(const Image<TFrom, CFrom>& from, Image<TTo, CTo>& to)
+//! \brief vectorized part of cast_channels(), returns the number of values done
+template<typename TFrom, typename TTo>
+inline int cast_channels(const TFrom*, TTo*, int)
 {
-    cast(from, to, internal::DefaultCaster<TFrom, CFrom, TTo, CTo>());
+    return 0;
 }
 
-// io --------------------------------------------------------------------------
-
-namespace stb {
-typedef unsigned char stbi_uc;
-typedef unsigned short stbi_us;
-inline void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
-inline void stbi_flip_vertically_on_write(int flip_boolean);
-inline stbi_uc *stbi_load(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
-inline int stbi_write_png(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes);
-inline void stbi_image_free(void *retval_from_stbi_load);
-} // namespace stb
+#ifdef IMG_SSE2
 
-template<typename T, int C>
-bool load(const std::string& filename, Image<T,C>& image, bool flip)
+#ifdef IMG_AVX2
+inline bool has_avx2()
 {
-    image.clear();
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
 
-    int width   = 0;
-    int height  = 0;
-    int channel = 0;
-    constexpr auto desired_channels = 0;
-    stb::stbi_set_flip_vertically_on_load(flip);
-    auto data = stb::stbi_load(filename.c_str(),
-                               &width,
-                               &height,
-                               &channel,
-                               desired_channels);
+//! \brief std::round() of 4 floats, that is with halfway cases away from zero
+inline __m128i round_epi32(__m128 x)
+{
+    const __m128i t    = _mm_cvttps_epi32(x);
+    const __m128  d    = _mm_sub_ps(x, _mm_cvtepi32_ps(t));
+    const __m128i up   = _mm_castps_si128(_mm_cmpge_ps(d, _mm_set1_ps( 0.5f)));
+    const __m128i down = _mm_castps_si128(_mm_cmple_ps(d, _mm_set1_ps(-0.5f)));
+    return _mm_add_epi32(_mm_sub_epi32(t, up), down);
+}
 
-    if(data == nullptr) return false;
+//! \brief low byte of 16 integers, as char(int) does
+inline __m128i pack_low_bytes(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    const __m128i ab = _mm_packs_epi32(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+    const __m128i cd = _mm_packs_epi32(_mm_and_si128(c, mask), _mm_and_si128(d, mask));
+    return _mm_packus_epi16(ab, cd);
+}
 
-    image = Image<T,C>(height, width, data, channel);
+//! \brief low 16 bits of 8 integers, as unsigned short(int) does
+inline __m128i pack_low_words(__m128i a, __m128i b)
+{
+    // sign-extended low halves are packed without saturation
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                           _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
 
-    stb::stbi_image_free(data);
+//! \brief cast_channel() of 4 values, returned as the bits of TTo
+template<typename TFrom, typename TTo> inline __m128 convert4(const TFrom* from);
+template<> inline __m128 convert4<int,int>(const int* from) {
+    return _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(from)));
+}
+template<> inline __m128 convert4<float,float>(const float* from) {
+    return _mm_loadu_ps(from);
+}
+template<> inline __m128 convert4<int,float>(const int* from) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(from));
+    return _mm_div_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(255.f));
+}
+template<> inline __m128 convert4<float,int>(const float* from) {
+    const __m128 v = _mm_loadu_ps(from);
+    return _mm_castsi128_ps(_mm_cvttps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.f))));
+}
 
-    return true;
+//! \brief split 4 RGB(A) pixels into channels, on the bits of 32-bit values
+template<int C> inline void load_rgb(const void* from, __m128& r, __m128& g, __m128& b);
+template<> inline void load_rgb<3>(const void* from, __m128& r, __m128& g, __m128& b) {
+    const float* p = static_cast<const float*>(from);
+    const __m128 x = _mm_loadu_ps(p);     // r0 g0 b0 r1
+    const __m128 y = _mm_loadu_ps(p + 4); // g1 b1 r2 g2
+    const __m128 z = _mm_loadu_ps(p + 8); // b2 r3 g3 b3
+    r = _mm_shuffle_ps(x, _mm_shuffle_ps(y, z, _MM_SHUFFLE(1,1,2,2)), _MM_SHUFFLE(2,0,3,0));
+    g = _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0,0,1,1)),
+                       _mm_shuffle_ps(y, z, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+    b = _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(1,1,2,2)),
+                       _mm_shuffle_ps(z, z, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+}
+template<> inline void load_rgb<4>(const void* from, __m128& r, __m128& g, __m128& b) {
+    const float* p = static_cast<const float*>(from);
+    __m128 x = _mm_loadu_ps(p);
+    __m128 y = _mm_loadu_ps(p + 4);
+    __m128 z = _mm_loadu_ps(p + 8);
+    __m128 w = _mm_loadu_ps(p + 12);
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+    r = x;
+    g = y;
+    b = z;
 }
 
-template<typename T, int C>
-bool save(const std::string& filename, const Image<T,C>& image, bool flip)
+//! \brief Average<TFrom,TTo> of 4 RGB(A) pixels, returned as the bits of TTo
+//! \warning integer averages are exact for sums in [-16383,16383] only
+template<typename TFrom, int CFrom, typename TTo>
+inline __m128 average4(const TFrom* from)
 {
-    std::vector<char> data(image.capacity());
-    for(int k = 0; k < image.capacity(); ++k)
+    __m128 r, g, b;
+    load_rgb<CFrom>(from, r, g, b);
+    if constexpr(std::is_same<TFrom,float>::value)
     {
-        data[k] = internal::cast_channel<T,char>(image.data()[k]);
+        const __m128 avg = _mm_div_ps(_mm_add_ps(_mm_add_ps(r, g), b), _mm_set1_ps(3.f));
+        if constexpr(std::is_same<TTo,float>::value)
+            return avg;
+        else
+            return _mm_castsi128_ps(_mm_cvttps_epi32(_mm_mul_ps(avg, _mm_set1_ps(255.f))));
+    }
+    else
+    {
+        const __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_castps_si128(r),
+                                                        _mm_castps_si128(g)),
+                                                        _mm_castps_si128(b));
+        if constexpr(std::is_same<TTo,float>::value)
+        {
+            return _mm_div_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(3.f * 255.f));
+        }
+        else
+        {
+            // round(sum/3) in 16-bit fixed point as (sum * 21846 + 2^15) >> 16
+            const __m128i s16   = _mm_packs_epi32(sum, sum);
+            const __m128i third = _mm_set1_epi16(21846);
+            const __m128i q = _mm_add_epi16(_mm_mulhi_epi16(s16, third),
+                              _mm_srli_epi16(_mm_mullo_epi16(s16, third), 15));
+            return _mm_castsi128_ps(_mm_srai_epi32(_mm_unpacklo_epi16(q, q), 16));
+        }
     }
-
-    stb::stbi_flip_vertically_on_write(flip);
-    const auto ok = stb::stbi_write_png(filename.c_str(),
-                                        image.width(),
-                                        image.height(),
-                                        image.depth(),
-                                        data.data(), 0);
-
-    return ok;
 }
 
-// Image -----------------------------------------------------------------------
-
-template<typename T, int C>
-Image<T,C>::Image() : Image(0, 0)
+//! \brief true if the 4 RGB(A) integer pixels can be averaged in fixed point
+template<int CFrom>
+inline bool fixed_point_range(const int* from)
 {
+    __m128 r, g, b;
+    load_rgb<CFrom>(from, r, g, b);
+    const __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_castps_si128(r),
+                                                    _mm_castps_si128(g)),
+                                                    _mm_castps_si128(b));
+    const __m128i out = _mm_or_si128(_mm_cmpgt_epi32(sum, _mm_set1_epi32( 16383)),
+                                     _mm_cmplt_epi32(sum, _mm_set1_epi32(-16383)));
+    return _mm_movemask_epi8(out) == 0;
 }
 
-template<typename T, int C>
-Image<T,C>::Image(int height, int width) :
-    m_height(height),
-    m_width(width),
-    m_data(C * width * height)
+#ifdef IMG_AVX2
+IMG_TARGET_AVX2 inline int cast_channels_avx2(const int* from, float* to, int n)
 {
+    int k = 0;
+    for(; k + 8 <= n; k += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(from + k));
+        _mm256_storeu_ps(to + k, _mm256_div_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(255.f)));
+    }
+    return k;
 }
 
-//!
-//! \brief used for io operations
-//! \warning data must point to an array of size height*size*depth
-//! \todo could be optimized since cast is used
-//!
-template<typename T, int C>
-Image<T,C>::Image(int height, int width, unsigned char* data, int depth) : Image(height, width)
+IMG_TARGET_AVX2 inline int cast_channels_avx2(const float* from, int* to, int n)
 {
-    assert(0 < depth && depth <= 4);
-
-         if(depth == 1) *this = Image<T,1>(height, width, data);
-    else if(depth == 2) *this = Image<T,2>(height, width, data);
-    else if(depth == 3) *this = Image<T,3>(height, width, data);
-    else if(depth == 4) *this = Image<T,4>(height, width, data);
+    int k = 0;
+    for(; k + 8 <= n; k += 8) {
+        const __m256 v = _mm256_mul_ps(_mm256_loadu_ps(from + k), _mm256_set1_ps(255.f));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + k), _mm256_cvttps_epi32(v));
+    }
+    return k;
+}
+
+IMG_TARGET_AVX2 inline int cast_channels_avx2(const float* from, char* to, int n)
+{
+    const __m256 scale = _mm256_set1_ps(255.f);
+    const __m256 half  = _mm256_set1_ps(0.5f);
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    int k = 0;
+    for(; k + 16 <= n; k += 16) {
+        __m256i q[2];
+        for(int i = 0; i < 2; ++i) {
+            // std::round() with halfway cases away from zero
+            const __m256  x = _mm256_mul_ps(_mm256_loadu_ps(from + k + 8 * i), scale);
+            const __m256i t = _mm256_cvttps_epi32(x);
+            const __m256  d = _mm256_sub_ps(x, _mm256_cvtepi32_ps(t));
+            const __m256i up   = _mm256_castps_si256(_mm256_cmp_ps(d, half, _CMP_GE_OQ));
+            const __m256i down = _mm256_castps_si256(_mm256_cmp_ps(d, _mm256_sub_ps(_mm256_setzero_ps(), half), _CMP_LE_OQ));
+            q[i] = _mm256_and_si256(_mm256_add_epi32(_mm256_sub_epi32(t, up), down), mask);
+        }
+        // packs work within 128-bit lanes, reorder 32-bit groups afterwards
+        const __m256i w = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_setzero_si256());
+        const __m256i p = _mm256_permutevar8x32_epi32(w, _mm256_setr_epi32(0,4,1,5,2,6,3,7));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k), _mm256_castsi256_si128(p));
+    }
+    return k;
 }
-
-//!
-//! \brief used for io operations
-//! \warning data must point to an array of size height*size*C
-//!
-template<typename T, int C>
-Image<T,C>::Image(int height, int width, unsigned char* data) : Image(height, width)
+IMG_TARGET_AVX2 inline int cast_channels_avx2(const unsigned char* from, float* to, int n)
 {
-    for(int k = 0; k < height * width * C; ++k)
-    {
-        m_data[k] = internal::cast_channel<unsigned char,T>(data[k]);
+    int k = 0;
+    for(; k + 8 <= n; k += 8) {
+        const __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(from + k));
+        const __m256  v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(b));
+        _mm256_storeu_ps(to + k, _mm256_div_ps(v, _mm256_set1_ps(255.f)));
     }
+    return k;
 }
+#endif // IMG_AVX2
 
-template<typename T, int C>
-template<typename T2, int C2>
-Image<T,C>::Image(const Image<T2,C2>& other)  :
-    m_height(other.height()),
-    m_width(other.width()),
-    m_data(C * other.width() * other.height())
+//! \brief zero-extend the 16 bytes of b to 4 vectors of 32-bit integers
+inline void unpack_bytes(__m128i b, __m128i* v)
 {
-    img::cast(other, *this);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_unpacklo_epi8(b, zero);
+    const __m128i hi = _mm_unpackhi_epi8(b, zero);
+    v[0] = _mm_unpacklo_epi16(lo, zero);
+    v[1] = _mm_unpackhi_epi16(lo, zero);
+    v[2] = _mm_unpacklo_epi16(hi, zero);
+    v[3] = _mm_unpackhi_epi16(hi, zero);
 }
 
-template<typename T, int C>
-template<typename T2, int C2>
-Image<T,C>& Image<T,C>::operator=(const Image<T2,C2>& other)
+inline int cast_channels(const unsigned char* from, float* to, int n)
 {
-    img::cast(other, *this);
-    return *this;
+#ifdef IMG_AVX2
+    if(has_avx2()) return cast_channels_avx2(from, to, n);
+#endif
+    const __m128 one = _mm_set1_ps(255.f);
+    int k = 0;
+    for(; k + 16 <= n; k += 16) {
+        __m128i v[4];
+        unpack_bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(from + k)), v);
+        for(int i = 0; i < 4; ++i)
+            _mm_storeu_ps(to + k + 4 * i, _mm_div_ps(_mm_cvtepi32_ps(v[i]), one));
+    }
+    return k;
 }
 
-// Cast ------------------------------------------------------------------------
-
-template<typename T, int C>
-template<class Image2>
-Image2 Image<T,C>::cast() const
+inline int cast_channels(const unsigned char* from, int* to, int n)
 {
-    return Image2(*this);
+    int k = 0;
+    for(; k + 16 <= n; k += 16) {
+        __m128i v[4];
+        unpack_bytes(_mm_loadu_si128(reinterpret_cast<const __m128i*>(from + k)), v);
+        for(int i = 0; i < 4; ++i)
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k + 4 * i), v[i]);
+    }
+    return k;
 }
 
-template<typename T, int C>
-template<typename T2, int C2>
-Image<T2,C2> Image<T,C>::cast() const
+inline int cast_channels(const int* from, float* to, int n)
 {
-    return Image<T2,C2>(*this);
+#ifdef IMG_AVX2
+    if(has_avx2()) return cast_channels_avx2(from, to, n);
+#endif
+    int k = 0;
+    for(; k + 4 <= n; k += 4)
+        _mm_storeu_ps(to + k, convert4<int,float>(from + k));
+    return k;
 }
 
-// Capacity --------------------------------------------------------------------
-
-template<typename T, int C>
-bool Image<T,C>::empty()
+inline int cast_channels(const float* from, int* to, int n)
 {
-    return m_data.empty();
+#ifdef IMG_AVX2
+    if(has_avx2()) return cast_channels_avx2(from, to, n);
+#endif
+    int k = 0;
+    for(; k + 4 <= n; k += 4)
+        _mm_storeu_ps(reinterpret_cast<float*>(to + k), convert4<float,int>(from + k));
+    return k;
 }
 
-template<typename T, int C>
-int Image<T,C>::height() const
+inline int cast_channels(const float* from, char* to, int n)
 {
-    return m_height;
+#ifdef IMG_AVX2
+    if(has_avx2()) return cast_channels_avx2(from, to, n);
+#endif
+    const __m128 scale = _mm_set1_ps(255.f);
+    int k = 0;
+    for(; k + 16 <= n; k += 16) {
+        const __m128i a = round_epi32(_mm_mul_ps(_mm_loadu_ps(from + k     ), scale));
+        const __m128i b = round_epi32(_mm_mul_ps(_mm_loadu_ps(from + k +  4), scale));
+        const __m128i c = round_epi32(_mm_mul_ps(_mm_loadu_ps(from + k +  8), scale));
+        const __m128i d = round_epi32(_mm_mul_ps(_mm_loadu_ps(from + k + 12), scale));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k), pack_low_bytes(a, b, c, d));
+    }
+    return k;
 }
 
-template<typename T, int C>
-int Image<T,C>::width() const
+inline int cast_channels(const int* from, char* to, int n)
 {
-    return m_width;
+    const __m128i* p = reinterpret_cast<const __m128i*>(from);
+    int k = 0;
+    for(; k + 16 <= n; k += 16, p += 4) {
+        const __m128i v = pack_low_bytes(_mm_loadu_si128(p    ), _mm_loadu_si128(p + 1),
+                                         _mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k), v);
+    }
+    return k;
 }
 
-template<typename T, int C>
-constexpr int Image<T,C>::depth()
+inline int cast_channels(const unsigned short* from, float* to, int n)
 {
-    return C;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128  one  = _mm_set1_ps(65535.f);
+    int k = 0;
+    for(; k + 8 <= n; k += 8) {
+        const __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + k));
+        _mm_storeu_ps(to + k,     _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero)), one));
+        _mm_storeu_ps(to + k + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(w, zero)), one));
+    }
+    return k;
+}
+
+inline int cast_channels(const unsigned short* from, int* to, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(32767);
+    int k = 0;
+    for(; k + 8 <= n; k += 8) {
+        const __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + k));
+        const __m128i v[2] = {_mm_unpacklo_epi16(w, zero), _mm_unpackhi_epi16(w, zero)};
+        for(int i = 0; i < 2; ++i) {
+            // x / 65535 as (x + (x >> 16) + 1) >> 16, exact for x = 255 * v + 32767
+            const __m128i x = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(v[i], 8), v[i]), half);
+            const __m128i q = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 16)),
+                                                           _mm_set1_epi32(1)), 16);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k + 4 * i), q);
+        }
+    }
+    return k;
 }
 
-template<typename T, int C>
-int Image<T,C>::size() const
+inline int cast_channels(const float* from, unsigned short* to, int n)
 {
-    return m_height * m_width;
+    const __m128 scale = _mm_set1_ps(65535.f);
+    int k = 0;
+    for(; k + 8 <= n; k += 8) {
+        const __m128i a = round_epi32(_mm_mul_ps(_mm_loadu_ps(from + k    ), scale));
+        const __m128i b = round_epi32(_mm_mul_ps(_mm_loadu_ps(from + k + 4), scale));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k), pack_low_words(a, b));
+    }
+    return k;
 }
 
-template<typename T, int C>
-int Image<T,C>::capacity() const
+inline int cast_channels(const int* from, unsigned short* to, int n)
 {
-    return m_height * m_width * C;
+    const __m128i* p = reinterpret_cast<const __m128i*>(from);
+    int k = 0;
+    for(; k + 8 <= n; k += 8, p += 2) {
+        const __m128i a = _mm_loadu_si128(p);
+        const __m128i b = _mm_loadu_si128(p + 1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(to + k),
+                         pack_low_words(_mm_add_epi32(_mm_slli_epi32(a, 8), a),
+                                        _mm_add_epi32(_mm_slli_epi32(b, 8), b)));
+    }
+    return k;
 }
 
-template<typename T, int C>
-int Image<T,C>::rows() const
+#endif // IMG_SSE2
+
+} // namespace simd
+
+//!
+//! \brief cast_channel() applied to n contiguous values
+//!
+template<typename TFrom, typename TTo>
+inline void cast_channels(const TFrom* from, TTo* to, int n)
 {
-    return m_height;
+    int k = simd::cast_channels(from, to, n);
+    for(; k < n; ++k)
+        to[k] = cast_channel<TFrom,TTo>(from[k]);
 }
 
-template<typename T, int C>
-int Image<T,C>::cols() const
+//!
+//! \brief Vectorized equivalent of DefaultCaster for n contiguous pixels
+//! \note available only for the most common conversions between int and float
+//!
+template<typename TFrom, int CFrom, typename TTo, int CTo>
+struct RowCaster {
+    static constexpr bool available = false;
+};
+
+//! \brief int to float or float to int
+template<typename TFrom, typename TTo, int C> struct RowCaster<TFrom,C,TTo,C> {
+    static constexpr bool available = simd::is_vectorized<TFrom>() &&
+                                      simd::is_vectorized<TTo>() &&
+                                      !std::is_same<TFrom,TTo>::value;
+    static void run(const TFrom* from, TTo* to, int n) {
+        cast_channels(from, to, C * n);
+    }
+};
+
+//! \brief RGB(A) to G
+template<typename TFrom, int CFrom, typename TTo> struct RowAverage {
+    static constexpr bool available = simd::is_vectorized<TFrom>() &&
+                                      simd::is_vectorized<TTo>();
+    static void run(const TFrom* from, TTo* to, int n) {
+        int k = 0;
+#ifdef IMG_SSE2
+        for(; k + 4 <= n; k += 4) {
+            if constexpr(std::is_same<TFrom,int>::value && std::is_same<TTo,int>::value) {
+                if(!simd::fixed_point_range<CFrom>(from + CFrom * k)) {
+                    compute(from, to, k, k + 4);
+                    continue;
+                }
+            }
+            _mm_storeu_ps(reinterpret_cast<float*>(to + k),
+                          simd::average4<TFrom,CFrom,TTo>(from + CFrom * k));
+        }
+#endif
+        compute(from, to, k, n);
+    }
+    static void compute(const TFrom* from, TTo* to, int first, int last) {
+        for(int k = first; k < last; ++k) {
+            const TFrom* c = from + CFrom * k;
+            to[k] = Average<TFrom,TTo>::compute(c[0], c[1], c[2]);
+        }
+    }
+};
+template<typename TFrom, typename TTo> struct RowCaster<TFrom,4,TTo,1> : RowAverage<TFrom,4,TTo> {};
+template<typename TFrom, typename TTo> struct RowCaster<TFrom,3,TTo,1> : RowAverage<TFrom,3,TTo> {};
+
+//! \brief G to RGB
+template<typename TFrom, typename TTo> struct RowCaster<TFrom,1,TTo,3> {
+    static constexpr bool available = simd::is_vectorized<TFrom>() &&
+                                      simd::is_vectorized<TTo>();
+    static void run(const TFrom* from, TTo* to, int n) {
+        int k = 0;
+#ifdef IMG_SSE2
+        for(; k + 4 <= n; k += 4) {
+            const __m128 g = simd::convert4<TFrom,TTo>(from + k);
+            float* p = reinterpret_cast<float*>(to + 3 * k);
+            _mm_storeu_ps(p,     _mm_shuffle_ps(g, g, _MM_SHUFFLE(1,0,0,0)));
+            _mm_storeu_ps(p + 4, _mm_shuffle_ps(g, g, _MM_SHUFFLE(2,2,1,1)));
+            _mm_storeu_ps(p + 8, _mm_shuffle_ps(g, g, _MM_SHUFFLE(3,3,3,2)));
+        }
+#endif
+        for(; k < n; ++k)
+            to[3 * k] = to[3 * k + 1] = to[3 * k + 2] = cast_channel<TFrom,TTo>(from[k]);
+    }
+};
+
+} // namespace internal
+
+// parallel --------------------------------------------------------------------
+
+namespace internal {
+
+//!
+//! \brief minimal number of pixels for which cast() runs in parallel
+//!
+#ifndef IMG_PARALLEL_MIN_SIZE
+#define IMG_PARALLEL_MIN_SIZE 65536
+#endif
+
+#ifndef IMG_NO_THREADS
+
+//!
+//! \brief Fixed-size pool of worker threads executing queued tasks
+//!
+class ThreadPool
 {
-    return m_width;
-}
+public:
+    inline explicit ThreadPool(int thread_count);
+    inline ~ThreadPool();
 
-// Accessors -------------------------------------------------------------------
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
 
-template<typename T, int C>
-typename Image<T,C>::ColorAccess Image<T,C>::operator()(int i, int j)
+    inline int thread_count() const;
+    inline void push(std::function<void()> task);
+
+    //! \brief shared pool with one worker per hardware thread but the caller's
+    static inline ThreadPool& instance();
+
+protected:
+    inline void run();
+
+protected:
+    std::vector<std::thread>          m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex                        m_mutex;
+    std::condition_variable           m_condition;
+    bool                              m_stop;
+};
+
+ThreadPool::ThreadPool(int thread_count) :
+    m_threads(),
+    m_tasks(),
+    m_mutex(),
+    m_condition(),
+    m_stop(false)
 {
-    if constexpr(C == 1)
-        return *at(i,j);
-    else
-        return ColorAccess(at(i,j));
+    for(int i = 0; i < thread_count; ++i)
+        m_threads.emplace_back([this](){this->run();});
 }
 
-template<typename T, int C>
-typename Image<T,C>::ConstColorAccess Image<T,C>::operator()(int i, int j) const
+ThreadPool::~ThreadPool()
 {
-    if constexpr(C == 1)
-        return *at(i,j);
-    else
-        return ConstColorAccess(at(i,j));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_all();
+    for(auto& thread : m_threads)
+        thread.join();
 }
 
-template<typename T, int C>
-typename Image<T,C>::ColorAccess Image<T,C>::operator()(int k)
+int ThreadPool::thread_count() const
 {
-    if constexpr(C == 1)
-        return *at(k);
-    else
-        return ColorAccess(at(k));
+    return int(m_threads.size());
 }
 
-template<typename T, int C>
-typename Image<T,C>::ConstColorAccess Image<T,C>::operator()(int k) const
+void ThreadPool::push(std::function<void()> task)
 {
-    if constexpr(C == 1)
-        return *at(k);
-    else
-        return ConstColorAccess(at(k));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_condition.notify_one();
 }
 
-template<typename T, int C>
-const std::vector<T>& Image<T,C>::data() const
+ThreadPool& ThreadPool::instance()
 {
-    return m_data;
+    static ThreadPool pool(std::max(0, int(std::thread::hardware_concurrency()) - 1));
+    return pool;
 }
 
-template<typename T, int C>
-std::vector<T>& Image<T,C>::data()
+void ThreadPool::run()
 {
-    return m_data;
+    for(;;)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this](){return m_stop || !m_tasks.empty();});
+            if(m_stop && m_tasks.empty()) return;
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
+
+#endif // IMG_NO_THREADS
+
+//!
+//! \brief Call func(first,last) on consecutive ranges of at most chunk indices
+//! covering [begin,end), using the shared thread pool
+//!
+//! The calling thread processes ranges too, so that parallel_for can safely be
+//! nested or called from a task of the pool.
+//! The first exception thrown by func is rethrown once all ranges are done.
+//!
+template<class Func>
+inline void parallel_for(int begin, int end, int chunk, Func&& func)
+{
+    if(end <= begin) return;
+#ifdef IMG_NO_THREADS
+    (void)chunk;
+    func(begin, end);
+#else
+    chunk = std::max(1, chunk);
+    const int count = (end - begin + chunk - 1) / chunk;
+    auto& pool = ThreadPool::instance();
+    if(count == 1 || pool.thread_count() == 0)
+    {
+        func(begin, end);
+        return;
+    }
+
+    struct Job {
+        std::atomic<int>        next{0};
+        std::atomic<int>        done{0};
+        std::mutex              mutex;
+        std::condition_variable condition;
+        std::exception_ptr      error;
+    };
+    const auto job = std::make_shared<Job>();
+
+    // func is only accessed while ranges remain, hence while the caller waits
+    const auto work = [job, begin, end, chunk, count, &func]()
+    {
+        for(int c = job->next++; c < count; c = job->next++)
+        {
+            const int first = begin + c * chunk;
+            const int last  = std::min(end, first + chunk);
+            try
+            {
+                func(first, last);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                if(!job->error) job->error = std::current_exception();
+            }
+            if(++job->done == count)
+            {
+                std::lock_guard<std::mutex> lock(job->mutex);
+                job->condition.notify_all();
+            }
+        }
+    };
+
+    const int helpers = std::min(count - 1, pool.thread_count());
+    for(int i = 0; i < helpers; ++i)
+        pool.push(work);
+    work();
+
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->condition.wait(lock, [&job, count](){return job->done == count;});
+    if(job->error) std::rethrow_exception(job->error);
+#endif
+}
+
+//!
+//! \brief Call func(first,last) on ranges of rows of an image of given size,
+//! serially if the image is smaller than IMG_PARALLEL_MIN_SIZE pixels
+//!
+template<class Func>
+inline void parallel_rows(int height, int width, Func&& func)
+{
+    if(height * width < IMG_PARALLEL_MIN_SIZE)
+    {
+        func(0, height);
+        return;
+    }
+#ifdef IMG_NO_THREADS
+    func(0, height);
+#else
+    // a few ranges per thread to balance the load, but not too small ones
+    const int threads = ThreadPool::instance().thread_count() + 1;
+    const int chunk   = std::max(std::max(1, 4096 / std::max(1, width)),
+                                 height / (4 * threads));
+    parallel_for(0, height, chunk, func);
+#endif
+}
+
+//!
+//! \brief Convert contiguous 8-bit or 16-bit pixels with CFrom channels into
+//! the pixels of to, in a single pass giving the same result as converting the
+//! channels to T and then casting to C channels with DefaultCaster
+//!
+template<int CFrom, typename TFrom, typename T, int C>
+inline void cast_pixels(const TFrom* from, Image<T,C>& to)
+{
+    const int width = to.width();
+    parallel_rows(to.height(), width, [&](int first, int last)
+    {
+        if constexpr(CFrom == C)
+        {
+            cast_channels(from       + C * width * first,
+                          to.raw()   + C * width * first,
+                          C * width * (last - first));
+        }
+        else
+        {
+            DefaultCaster<T, CFrom, T, C> caster;
+            for(int k = first * width; k < last * width; ++k)
+            {
+                T color[CFrom];
+                for(int c = 0; c < CFrom; ++c)
+                    color[c] = cast_channel<TFrom,T>(from[CFrom * k + c]);
+                if constexpr(CFrom == 1)
+                    to(k) = caster(color[0]);
+                else
+                    to(k) = caster(typename Image<T,CFrom>::ConstColorAccess(color));
+            }
+        }
+    });
+}
+
+//! \brief cast_pixels() for a number of channels known at runtime
+template<typename TFrom, typename T, int C>
+inline void cast_pixels(const TFrom* from, int depth, Image<T,C>& to)
+{
+    assert(0 < depth && depth <= 4);
+
+         if(depth == 1) cast_pixels<1>(from, to);
+    else if(depth == 2) cast_pixels<2>(from, to);
+    else if(depth == 3) cast_pixels<3>(from, to);
+    else if(depth == 4) cast_pixels<4>(from, to);
+}
+
+} // namespace internal
+
+// cast ------------------------------------------------------------------------
+
+//!
+//! \brief Convert each pixel of from into to using caster
+//!
+//! Large images are converted in parallel by ranges of rows, so caster may be
+//! called concurrently from several threads.
+//!
+template<typename TFrom, int CFrom, typename TTo, int CTo, class Caster>
+void cast(const Image<TFrom, CFrom>& from, Image<TTo, CTo>& to, Caster&& caster)
+{
+    to.resize(from.height(), from.width());
+    const int width = from.width();
+    internal::parallel_rows(from.height(), width, [&](int first, int last)
+    {
+        for (int k = first * width; k < last * width; ++k)
+        {
+            to(k) = caster(from(k));
+        }
+    });
+}
+
+//!
+//! \brief Convert from into to using the default conversion, vectorized for
+//! the most common pairs of types and channels
+//!
+template<typename TFrom, int CFrom, typename TTo, int CTo>
+void cast(const Image<TFrom, CFrom>& from, Image<TTo, CTo>& to)
+{
+    using RowCaster = internal::RowCaster<TFrom, CFrom, TTo, CTo>;
+    if constexpr(RowCaster::available)
+    {
+        to.resize(from.height(), from.width());
+        const int width = from.width();
+        internal::parallel_rows(from.height(), width, [&](int first, int last)
+        {
+            RowCaster::run(from.raw() + CFrom * width * first,
+                           to.raw()   + CTo   * width * first,
+                           width * (last - first));
+        });
+    }
+    else
+    {
+        cast(from, to, internal::DefaultCaster<TFrom, CFrom, TTo, CTo>());
+    }
+}
+
+// io --------------------------------------------------------------------------
+
+namespace stb {
+typedef unsigned char stbi_uc;
+typedef unsigned short stbi_us;
+
+// options of a single load; the stbi_set_* functions only set the defaults used
+// by the calls that take no options, for the calling thread
+typedef struct
+{
+   int flip_vertically;           // see stbi_set_flip_vertically_on_load
+   int unpremultiply;             // see stbi_set_unpremultiply_on_load
+   int convert_iphone_png_to_rgb; // see stbi_convert_iphone_png_to_rgb
+   int verify_checksums;          // fail on a bad crc of an IDAT chunk or adler-32 of the image data
+} stbi_load_options;
+
+// runs job(jobs, i) for all i in [0,count), in any order and on any thread
+typedef void stbi_write_parallel_func(void *context, int count, void (*job)(void *jobs, int i), void *jobs);
+
+// options of a single png write, used instead of the stbi_write_* defaults
+typedef struct
+{
+   int compression_level;
+   int force_filter;      // 0 to 4 forces the filter of all rows, -1 picks one per row
+   int flip_vertically;   // rows are requested bottom-up
+   int bits_per_channel;  // 8, or 16 for rows of big-endian 16-bit values
+
+   // when not NULL, rows are filtered in parallel and images larger than one
+   // chunk are deflated by independent chunks, parallel_chunks of them per call
+   // of parallel
+   stbi_write_parallel_func *parallel;
+   void *parallel_context;
+   int parallel_chunks;
+} stbi_write_png_options;
+
+inline void *stbi_load_with_options(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int *bits_per_channel, stbi_load_options const *options);
+inline void *stbi_load_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int *bits_per_channel, stbi_load_options const *options);
+inline const char *stbi_failure_reason(void);
+inline int stbi_info_with_bits(char const *filename, int *x, int *y, int *comp, int *bits_per_channel);
+inline int stbi_info_from_memory_with_bits(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *bits_per_channel);
+typedef void stbi_write_func(void *context, void *data, int size);
+typedef void stbi_write_row_func(void *context, int y, unsigned char *row);
+inline int stbi_write_png_rows(char const *filename, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, stbi_write_png_options const *options);
+inline int stbi_write_png_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, stbi_write_png_options const *options);
+inline void stbi_image_free(void *retval_from_stbi_load);
+static int stbi__err(const char *str);
+} // namespace stb
+
+namespace internal {
+
+inline stb::stbi_load_options stb_options(const LoadOptions& options)
+{
+    stb::stbi_load_options stb_options;
+    stb_options.flip_vertically           = options.flip;
+    stb_options.unpremultiply             = options.unpremultiply;
+    stb_options.convert_iphone_png_to_rgb = options.de_iphone;
+    stb_options.verify_checksums          = options.verify;
+    return stb_options;
+}
+
+inline stb::stbi_write_png_options stb_options(const SaveOptions& options)
+{
+    stb::stbi_write_png_options stb_options;
+    stb_options.compression_level = options.compression_level;
+    stb_options.force_filter      = options.filter;
+    stb_options.flip_vertically   = options.flip;
+    stb_options.bits_per_channel  = options.bits;
+    stb_options.parallel          = nullptr;
+    stb_options.parallel_context  = nullptr;
+    stb_options.parallel_chunks   = 0;
+#ifndef IMG_NO_THREADS
+    if(options.parallel)
+    {
+        stb_options.parallel = [](void*, int count, void (*job)(void*, int), void* jobs)
+        {
+            parallel_for(0, count, 1, [&](int first, int last)
+            {
+                for(int i = first; i < last; ++i)
+                    job(jobs, i);
+            });
+        };
+        // the output does not depend on the number of chunks per batch
+        stb_options.parallel_chunks = 2 * (ThreadPool::instance().thread_count() + 1);
+    }
+#endif
+    return stb_options;
+}
+
+//!
+//! \brief Read-only memory mapping of a whole regular file
+//!
+//! The mapping is empty for pipes, special files, empty files, or when mapping
+//! is not available (macro IMG_NO_MMAP), in which case the file must be read
+//! through stdio.
+//!
+class MappedFile
+{
+public:
+    inline explicit MappedFile(const std::string& filename);
+    inline ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    inline bool valid() const;
+    inline const unsigned char* data() const;
+    inline std::size_t size() const;
+
+protected:
+    void*       m_data;
+    std::size_t m_size;
+};
+
+MappedFile::MappedFile(const std::string& filename) :
+    m_data(nullptr),
+    m_size(0)
+{
+#ifdef IMG_MMAP
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    struct stat status;
+    if(::fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0)
+    {
+        const auto size = std::size_t(status.st_size);
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED)
+        {
+            ::madvise(data, size, MADV_SEQUENTIAL);
+            m_data = data;
+            m_size = size;
+        }
+    }
+    ::close(fd);
+#else
+    (void)filename;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef IMG_MMAP
+    if(m_data) ::munmap(m_data, m_size);
+#endif
+}
+
+bool MappedFile::valid() const
+{
+    return m_data != nullptr;
+}
+
+const unsigned char* MappedFile::data() const
+{
+    return static_cast<const unsigned char*>(m_data);
+}
+
+std::size_t MappedFile::size() const
+{
+    return m_size;
+}
+
+//!
+//! \brief Fill image with the pixels returned by
+//! stb_load(&width,&height,&channel,desired_channels,&bits)
+//!
+//! 16-bit files are converted from their 16-bit values directly.
+//!
+template<typename T, int C, class Load>
+inline bool load_stb(Image<T,C>& image, Load&& stb_load)
+{
+    image.clear();
+
+    int width   = 0;
+    int height  = 0;
+    int channel = 0;
+    int bits    = 8;
+    // the decoder adds or removes channels as DefaultCaster does, except
+    // for gray levels computed from RGB(A) pixels
+    constexpr auto desired_channels = C >= 3 ? C : 0;
+    auto data = stb_load(&width, &height, &channel, desired_channels, &bits);
+
+    if(data == nullptr) return false;
+
+    const auto depth = desired_channels ? desired_channels : channel;
+    if(bits == 16)
+    {
+        image.resize(height, width);
+        cast_pixels(static_cast<const unsigned short*>(data), depth, image);
+    }
+    else
+    {
+        image = Image<T,C>(height, width, static_cast<unsigned char*>(data), depth);
+    }
+
+    stb::stbi_image_free(data);
+
+    return true;
+}
+
+//!
+//! \brief stbi_write_row_func of an Image<T,C>
+//!
+//! Rows are converted to bytes one at a time, right before the encoder filters
+//! and compresses them.
+//!
+template<typename T, int C>
+inline void convert_row(void* context, int i, unsigned char* row)
+{
+    const auto& image = *static_cast<const Image<T,C>*>(context);
+    const auto  count = C * image.width();
+    internal::cast_channels(image.raw() + count * i,
+                            reinterpret_cast<char*>(row),
+                            count);
+}
+
+//! \brief convert_row() for 16-bit PNG files, whose values are big-endian
+template<typename T, int C>
+inline void convert_row16(void* context, int i, unsigned char* row)
+{
+    const auto& image = *static_cast<const Image<T,C>*>(context);
+    const auto  count = C * image.width();
+    const auto  words = reinterpret_cast<unsigned short*>(row);
+    internal::cast_channels(image.raw() + count * i, words, count);
+    for(int k = 0; k < count; ++k)
+    {
+        const unsigned short value = words[k];
+        row[2 * k    ] = static_cast<unsigned char>(value >> 8);
+        row[2 * k + 1] = static_cast<unsigned char>(value & 0xFF);
+    }
+}
+
+template<typename T, int C>
+inline stb::stbi_write_row_func* row_converter(const SaveOptions& options)
+{
+    return options.bits == 16 ? convert_row16<T,C> : convert_row<T,C>;
+}
+
+// pnm -------------------------------------------------------------------------
+
+//! \brief File formats of load(), save() and info(), from the file extension
+enum class FileFormat
+{
+    png,
+    pnm, //!< \brief .pnm, gray or RGB binary PGM/PPM
+    pgm, //!< \brief .pgm, gray binary PGM
+    ppm, //!< \brief .ppm, RGB binary PPM
+    pfm, //!< \brief .pfm, gray or RGB 32-bit float PFM
+    qoi, //!< \brief .qoi, RGB or RGBA QOI
+};
+
+//! \brief FileFormat of filename from its extension (any case), png by default
+inline FileFormat file_format(const std::string& filename)
+{
+    const auto dot = filename.find_last_of("./\\");
+    if(dot == std::string::npos || filename[dot] != '.')
+        return FileFormat::png;
+    auto extension = filename.substr(dot + 1);
+    for(auto& c : extension)
+        if('A' <= c && c <= 'Z') c = char(c - 'A' + 'a');
+    if(extension == "pnm") return FileFormat::pnm;
+    if(extension == "pgm") return FileFormat::pgm;
+    if(extension == "ppm") return FileFormat::ppm;
+    if(extension == "pfm") return FileFormat::pfm;
+    if(extension == "qoi") return FileFormat::qoi;
+    return FileFormat::png;
+}
+
+inline bool little_endian()
+{
+    const std::uint16_t one = 1;
+    unsigned char first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+//! \brief Header of a binary PGM (P5), PPM (P6) or PFM (Pf, PF) file
+struct PnmHeader
+{
+    int  width    = 0;
+    int  height   = 0;
+    int  channels = 0;
+    int  maxval   = 0;     //!< \brief largest value of PGM/PPM files, 0 for PFM
+    bool little   = false; //!< \brief PFM values are little-endian (negative scale)
+};
+
+//! \brief Next token of a PNM header, skipping whitespace and comments, along
+//! with the single whitespace that ends it
+inline bool pnm_token(std::FILE* file, char* token, int size)
+{
+    int c = std::fgetc(file);
+    while(c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '#')
+    {
+        if(c == '#')
+            while(c != EOF && c != '\n' && c != '\r') c = std::fgetc(file);
+        c = std::fgetc(file);
+    }
+    int n = 0;
+    while(c != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+    {
+        if(n + 1 == size) return false;
+        token[n++] = char(c);
+        c = std::fgetc(file);
+    }
+    token[n] = '\0';
+    return n > 0 && c != EOF;
+}
+
+inline bool pnm_integer(std::FILE* file, int& value)
+{
+    char token[16];
+    if(!pnm_token(file, token, sizeof(token))) return false;
+    char* end = nullptr;
+    const long number = strtol(token, &end, 10);
+    if(*end != '\0' || number <= 0 || number > INT_MAX) return false;
+    value = int(number);
+    return true;
+}
+
+//! \brief Read the header of file, which is left at the first pixel
+inline bool read_pnm_header(std::FILE* file, PnmHeader& header)
+{
+    char magic[2];
+    if(std::fread(magic, 1, 2, file) != 2 || magic[0] != 'P' ||
+       (magic[1] != '5' && magic[1] != '6' && magic[1] != 'f' && magic[1] != 'F'))
+        return stb::stbi__err("not PNM");
+
+    header = PnmHeader();
+    header.channels = magic[1] == '5' || magic[1] == 'f' ? 1 : 3;
+    if(!pnm_integer(file, header.width) || !pnm_integer(file, header.height))
+        return stb::stbi__err("bad PNM header");
+    if(magic[1] == 'f' || magic[1] == 'F')
+    {
+        // only the sign of the scale matters, values are read as they are
+        char token[64];
+        char* end = nullptr;
+        if(!pnm_token(file, token, sizeof(token)))
+            return stb::stbi__err("bad PNM header");
+        const double scale = strtod(token, &end);
+        if(*end != '\0' || !(scale != 0))
+            return stb::stbi__err("bad PNM header");
+        header.little = scale < 0;
+    }
+    else if(!pnm_integer(file, header.maxval) || header.maxval > 65535)
+    {
+        return stb::stbi__err("bad PNM header");
+    }
+
+    // pixels of the largest image must be indexable by an int
+    if(std::uint64_t(header.width) * header.height * 4 > std::uint64_t(INT_MAX))
+        return stb::stbi__err("too large");
+    return true;
+}
+
+//! \brief Whether file holds at least bytes past its position, true if it
+//! cannot be seeked
+inline bool pnm_holds(std::FILE* file, std::uint64_t bytes)
+{
+    const long position = std::ftell(file);
+    if(position < 0 || std::fseek(file, 0, SEEK_END) != 0)
+        return true;
+    const long end = std::ftell(file);
+    std::fseek(file, position, SEEK_SET);
+    return end < position || std::uint64_t(end - position) >= bytes;
+}
+
+//! \brief Read count samples of type S into samples, false if the file is
+//! truncated
+template<typename S>
+inline bool read_pnm_samples(std::FILE* file, std::size_t count, S* samples)
+{
+    if(std::fread(samples, sizeof(S), count, file) != count)
+        return stb::stbi__err("truncated PNM");
+    return true;
+}
+
+inline void swap_bytes(unsigned short* values, std::size_t count)
+{
+    for(std::size_t k = 0; k < count; ++k)
+        values[k] = (unsigned short)((values[k] >> 8) | (values[k] << 8));
+}
+
+inline void swap_bytes(float* values, std::size_t count)
+{
+    for(std::size_t k = 0; k < count; ++k)
+    {
+        std::uint32_t word;
+        memcpy(&word, values + k, 4);
+        word = (word >> 24) | ((word >> 8) & 0xFF00) | ((word << 8) & 0xFF0000) | (word << 24);
+        memcpy(values + k, &word, 4);
+    }
+}
+
+//! \brief Scale values of a PGM/PPM file to the full range of their type
+template<typename S>
+inline void scale_pnm_samples(S* samples, std::size_t count, int maxval)
+{
+    const unsigned int full = (unsigned int)(S(~S(0)));
+    for(std::size_t k = 0; k < count; ++k)
+        samples[k] = S((std::min((unsigned int)(samples[k]), (unsigned int)(maxval)) * full + maxval / 2) / maxval);
+}
+
+template<typename T, int C>
+inline void flip_rows(Image<T,C>& image)
+{
+    const auto row = std::size_t(C) * image.width();
+    for(int i = 0, j = image.height() - 1; i < j; ++i, --j)
+        for(std::size_t k = 0; k < row; ++k)
+            std::swap(image.raw()[row * i + k], image.raw()[row * j + k]);
+}
+
+//!
+//! \brief Load a binary PGM, PPM or PFM file, recognized by its magic number
+//!
+//! Pixels whose type and channels are the ones of the image (8-bit files of
+//! unsigned char images, PFM files of float images) are read straight into the
+//! image with a single read, others are read once and converted in parallel.
+//!
+template<typename T, int C>
+inline bool load_pnm(const std::string& filename, Image<T,C>& image, const LoadOptions& options)
+{
+    image.clear();
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if(file == nullptr)
+        return stb::stbi__err("can't fopen");
+
+    PnmHeader header;
+    bool ok = read_pnm_header(file, header);
+    if(ok)
+    {
+        const auto count = std::size_t(header.width) * header.height * header.channels;
+        const auto bytes = header.maxval == 0 ? 4 : header.maxval > 255 ? 2 : 1;
+        // a truncated header must not allocate the image it claims
+        if(!pnm_holds(file, std::uint64_t(count) * bytes))
+        {
+            std::fclose(file);
+            return stb::stbi__err("truncated PNM");
+        }
+        image.resize(header.height, header.width);
+        if(header.maxval == 0)
+        {
+            const bool swap = header.little != little_endian();
+            if(std::is_same<T, float>::value && header.channels == C)
+            {
+                const auto samples = reinterpret_cast<float*>(image.raw());
+                ok = read_pnm_samples(file, count, samples);
+                if(ok && swap) swap_bytes(samples, count);
+            }
+            else
+            {
+                std::vector<float> samples(count);
+                ok = read_pnm_samples(file, count, samples.data());
+                if(ok && swap) swap_bytes(samples.data(), count);
+                if(ok) cast_pixels(samples.data(), header.channels, image);
+            }
+        }
+        else if(header.maxval > 255)
+        {
+            std::vector<unsigned short> samples(count);
+            ok = read_pnm_samples(file, count, samples.data());
+            if(ok && little_endian()) swap_bytes(samples.data(), count);
+            if(ok && header.maxval != 65535) scale_pnm_samples(samples.data(), count, header.maxval);
+            if(ok) cast_pixels(samples.data(), header.channels, image);
+        }
+        else if(std::is_same<T, unsigned char>::value && header.channels == C && header.maxval == 255)
+        {
+            ok = read_pnm_samples(file, count, reinterpret_cast<unsigned char*>(image.raw()));
+        }
+        else
+        {
+            std::vector<unsigned char> samples(count);
+            ok = read_pnm_samples(file, count, samples.data());
+            if(ok && header.maxval != 255) scale_pnm_samples(samples.data(), count, header.maxval);
+            if(ok) cast_pixels(samples.data(), header.channels, image);
+        }
+    }
+    std::fclose(file);
+
+    if(!ok)
+    {
+        image.clear();
+        return false;
+    }
+    // PFM rows are stored from bottom to top
+    if(options.flip != (header.maxval == 0))
+        flip_rows(image);
+    return true;
+}
+
+//!
+//! \brief Write image, whose channels are the ones of the file (1 or 3), as a
+//! binary PGM/PPM file of SaveOptions::bits bits or as a PFM file
+//!
+//! Rows are converted by strips in parallel, float images are written as they
+//! are to PFM files.
+//!
+template<typename T, int C>
+inline bool write_pnm(const std::string& filename, const Image<T,C>& image, const SaveOptions& options, bool pfm)
+{
+    static_assert(C == 1 || C == 3, "PNM files have 1 or 3 channels");
+    if(image.size() == 0 || (!pfm && options.bits != 8 && options.bits != 16))
+        return false;
+
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if(file == nullptr)
+        return false;
+
+    const int height = image.height();
+    bool ok;
+    if(pfm)
+        ok = std::fprintf(file, "%s\n%d %d\n%s\n", C == 1 ? "Pf" : "PF", image.width(), height,
+                          little_endian() ? "-1.0" : "1.0") > 0;
+    else
+        ok = std::fprintf(file, "%s\n%d %d\n%d\n", C == 1 ? "P5" : "P6", image.width(), height,
+                          options.bits == 16 ? 65535 : 255) > 0;
+
+    // row i of the file is row source(i) of the image
+    const bool bottom_up = pfm != options.flip;
+    const auto source = [&](int i) {return bottom_up ? height - 1 - i : i;};
+    const auto count  = std::size_t(C) * image.width();
+
+    if(pfm && std::is_same<T, float>::value)
+    {
+        if(!bottom_up)
+            ok = ok && std::fwrite(image.raw(), sizeof(float), count * height, file) == count * height;
+        for(int i = 0; bottom_up && ok && i < height; ++i)
+            ok = std::fwrite(image.raw() + count * source(i), sizeof(float), count, file) == count;
+    }
+    else
+    {
+        const auto row   = count * (pfm ? sizeof(float) : std::size_t(options.bits / 8));
+        const int  strip = int(std::max(std::size_t(1), std::min(std::size_t(height), (std::size_t(1) << 20) / row)));
+        const auto convert = row_converter<T,C>(options);
+        std::vector<unsigned char> buffer(row * strip);
+        for(int first = 0; ok && first < height; first += strip)
+        {
+            const int last = std::min(height, first + strip);
+            parallel_for(first, last, std::max(1, int(4096 / count)), [&](int begin, int end)
+            {
+                for(int i = begin; i < end; ++i)
+                {
+                    const auto out = buffer.data() + row * (i - first);
+                    if(pfm)
+                        cast_channels(image.raw() + count * source(i), reinterpret_cast<float*>(out), int(count));
+                    else
+                        convert(const_cast<Image<T,C>*>(&image), source(i), out);
+                }
+            });
+            ok = std::fwrite(buffer.data(), row, last - first, file) == std::size_t(last - first);
+        }
+    }
+
+    ok = std::fclose(file) == 0 && ok;
+    if(!ok)
+        std::remove(filename.c_str());
+    return ok;
+}
+
+//! \brief Write image as a file of format, converting its channels to the ones
+//! of the file when they differ
+template<typename T, int C>
+inline bool save_pnm(const std::string& filename, const Image<T,C>& image, const SaveOptions& options, FileFormat format)
+{
+    const int channels = format == FileFormat::pgm ? 1 :
+                         format == FileFormat::ppm ? 3 : (C <= 2 ? 1 : 3);
+    const bool pfm = format == FileFormat::pfm;
+    if constexpr(C == 1 || C == 3)
+    {
+        if(channels == C)
+            return write_pnm(filename, image, options, pfm);
+    }
+    if(channels == 1)
+    {
+        Image<T,1> gray;
+        cast(image, gray);
+        return write_pnm(filename, gray, options, pfm);
+    }
+    Image<T,3> rgb;
+    cast(image, rgb);
+    return write_pnm(filename, rgb, options, pfm);
+}
+
+inline bool info_pnm(const std::string& filename, ImageInfo& image_info)
+{
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if(file == nullptr)
+        return stb::stbi__err("can't fopen");
+    PnmHeader header;
+    const bool ok = read_pnm_header(file, header);
+    std::fclose(file);
+    if(!ok)
+        return false;
+    image_info.height   = header.height;
+    image_info.width    = header.width;
+    image_info.channels = header.channels;
+    image_info.bits     = header.maxval == 0 ? 32 : header.maxval > 255 ? 16 : 8;
+    return true;
+}
+
+
+// qoi -------------------------------------------------------------------------
+
+constexpr unsigned char qoi_magic[4] = {'q','o','i','f'};
+constexpr unsigned char qoi_end[8]   = {0,0,0,0,0,0,0,1};
+constexpr std::size_t   qoi_header   = 14;
+
+inline std::uint32_t qoi_read32(const unsigned char* p)
+{
+    return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) |
+           (std::uint32_t(p[2]) <<  8) |  std::uint32_t(p[3]);
+}
+
+inline void qoi_write32(unsigned char* p, std::uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >>  8);
+    p[3] = (unsigned char)(value      );
+}
+
+//! \brief Slot of a pixel 0xAABBGGRR in the table of recently seen pixels
+inline int qoi_hash(std::uint32_t px)
+{
+    return int(((px & 0xFF) * 3 + ((px >> 8) & 0xFF) * 5 + ((px >> 16) & 0xFF) * 7 + (px >> 24) * 11) % 64);
+}
+
+//! \brief Read the header of a QOI file held in memory
+inline bool qoi_info(const unsigned char* data, std::size_t size, ImageInfo& image_info)
+{
+    if(size < qoi_header || memcmp(data, qoi_magic, 4) != 0)
+        return stb::stbi__err("not QOI");
+    const auto width    = qoi_read32(data + 4);
+    const auto height   = qoi_read32(data + 8);
+    const int  channels = data[12];
+    if(width == 0 || height == 0 || (channels != 3 && channels != 4) || data[13] > 1)
+        return stb::stbi__err("bad QOI header");
+    if(std::uint64_t(width) * height * 4 > std::uint64_t(INT_MAX))
+        return stb::stbi__err("too large");
+    image_info.height   = int(height);
+    image_info.width    = int(width);
+    image_info.channels = channels;
+    image_info.bits     = 8;
+    return true;
+}
+
+//! \brief Decode count pixels of N channels from the chunks [p,end) of a QOI
+//! file, false if they end too soon
+template<int N>
+inline bool qoi_decode(const unsigned char* p, const unsigned char* end, unsigned char* out, std::size_t count)
+{
+    const auto store = [&out](std::uint32_t px)
+    {
+        out[0] = (unsigned char)(px      );
+        out[1] = (unsigned char)(px >>  8);
+        out[2] = (unsigned char)(px >> 16);
+        if(N == 4) out[N - 1] = (unsigned char)(px >> 24);
+        out += N;
+    };
+
+    std::uint32_t index[64] = {};
+    std::uint32_t px = 0xFF000000u;
+    const auto last = out + N * count;
+    while(out != last)
+    {
+        if(p == end) return false;
+        const int b1 = *p++;
+        // every pixel is put in the table, even those of INDEX and RUN as
+        // pixels of the initial table are not in their slot
+        if(b1 < 0x40) // INDEX
+        {
+            px = index[b1];
+            index[qoi_hash(px)] = px;
+            store(px);
+            continue;
+        }
+        if(b1 >= 0xC0 && b1 < 0xFE) // RUN of the previous pixel
+        {
+            index[qoi_hash(px)] = px;
+            const auto run = std::min(std::size_t(b1 - 0xBF), std::size_t(last - out) / N);
+            for(std::size_t k = 0; k < run; ++k)
+                store(px);
+            continue;
+        }
+
+        if(b1 == 0xFE) // RGB
+        {
+            if(end - p < 3) return false;
+            px = (px & 0xFF000000u) | p[0] | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16);
+            p += 3;
+        }
+        else if(b1 == 0xFF) // RGBA
+        {
+            if(end - p < 4) return false;
+            px = p[0] | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+            p += 4;
+        }
+        else // DIFF and LUMA
+        {
+            int dr, dg, db;
+            if(b1 < 0x80)
+            {
+                dr = ((b1 >> 4) & 3) - 2;
+                dg = ((b1 >> 2) & 3) - 2;
+                db = ( b1       & 3) - 2;
+            }
+            else
+            {
+                if(p == end) return false;
+                const int b2 = *p++;
+                dg = (b1 & 0x3F) - 32;
+                dr = dg - 8 + (b2 >> 4);
+                db = dg - 8 + (b2 & 0x0F);
+            }
+            px = (px & 0xFF000000u) |
+                 ( (px        + dr) & 0xFF       ) |
+                 (((px >>  8) + dg) & 0xFF) <<  8 |
+                 (((px >> 16) + db) & 0xFF) << 16;
+        }
+        index[qoi_hash(px)] = px;
+        store(px);
+    }
+    return true;
+}
+
+//! \brief State of a QOI encoder fed with rows of pixels
+struct QoiEncoder
+{
+    std::uint32_t  index[64] = {};
+    std::uint32_t  prev      = 0xFF000000u;
+    int            run       = 0;
+    unsigned char* out       = nullptr;
+
+    template<int N>
+    inline void encode(const unsigned char* pixels, int count)
+    {
+        for(int k = 0; k < count; ++k, pixels += N)
+        {
+            const std::uint32_t px = pixels[0] | (std::uint32_t(pixels[1]) << 8) | (std::uint32_t(pixels[2]) << 16) |
+                                     (std::uint32_t(N == 4 ? pixels[N - 1] : 0xFF) << 24);
+            if(px == prev)
+            {
+                if(++run == 62) flush();
+                continue;
+            }
+            flush();
+
+            const int slot = qoi_hash(px);
+            if(index[slot] == px)
+            {
+                *out++ = (unsigned char)(slot);
+            }
+            else if((px >> 24) != (prev >> 24))
+            {
+                index[slot] = px;
+                *out++ = 0xFF;
+                out[0] = pixels[0]; out[1] = pixels[1]; out[2] = pixels[2]; out[3] = (unsigned char)(px >> 24);
+                out += 4;
+            }
+            else
+            {
+                index[slot] = px;
+                const int dr = (signed char)(unsigned char)( px        -  prev       );
+                const int dg = (signed char)(unsigned char)((px >>  8) - (prev >>  8));
+                const int db = (signed char)(unsigned char)((px >> 16) - (prev >> 16));
+                const int dr_dg = dr - dg;
+                const int db_dg = db - dg;
+                if(-2 <= dr && dr <= 1 && -2 <= dg && dg <= 1 && -2 <= db && db <= 1)
+                {
+                    *out++ = (unsigned char)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                }
+                else if(-8 <= dr_dg && dr_dg <= 7 && -32 <= dg && dg <= 31 && -8 <= db_dg && db_dg <= 7)
+                {
+                    *out++ = (unsigned char)(0x80 | (dg + 32));
+                    *out++ = (unsigned char)((dr_dg + 8) << 4 | (db_dg + 8));
+                }
+                else
+                {
+                    *out++ = 0xFE;
+                    out[0] = pixels[0]; out[1] = pixels[1]; out[2] = pixels[2];
+                    out += 3;
+                }
+            }
+            prev = px;
+        }
+    }
+
+    //! \brief End the current run of pixels equal to the previous one
+    inline void flush()
+    {
+        if(run > 0)
+            *out++ = (unsigned char)(0xC0 | (run - 1));
+        run = 0;
+    }
+};
+
+//!
+//! \brief Load a QOI file held in memory
+//!
+//! Pixels of unsigned char images with the channels of the file are decoded
+//! straight into the image, others are converted once decoded.
+//!
+template<typename T, int C>
+inline bool decode_qoi(const unsigned char* data, std::size_t size, Image<T,C>& image, const LoadOptions& options)
+{
+    image.clear();
+    ImageInfo header;
+    if(!qoi_info(data, size, header))
+        return false;
+
+    const auto count = std::size_t(header.width) * header.height;
+    const auto end   = data + size - std::min(size - qoi_header, sizeof(qoi_end));
+    // a run byte, the densest op, stands for at most 62 pixels
+    if(count > std::size_t(end - data - qoi_header) * 62)
+        return stb::stbi__err("corrupt QOI");
+    image.resize(header.height, header.width);
+
+    bool ok;
+    if(std::is_same<T, unsigned char>::value && header.channels == C)
+    {
+        const auto out = reinterpret_cast<unsigned char*>(image.raw());
+        ok = C == 3 ? qoi_decode<3>(data + qoi_header, end, out, count)
+                    : qoi_decode<4>(data + qoi_header, end, out, count);
+    }
+    else
+    {
+        std::vector<unsigned char> samples(count * header.channels);
+        ok = header.channels == 3 ? qoi_decode<3>(data + qoi_header, end, samples.data(), count)
+                                  : qoi_decode<4>(data + qoi_header, end, samples.data(), count);
+        if(ok) cast_pixels(samples.data(), header.channels, image);
+    }
+
+    if(!ok)
+    {
+        image.clear();
+        return stb::stbi__err("corrupt QOI");
+    }
+    if(options.flip)
+        flip_rows(image);
+    return true;
+}
+
+//! \brief Load a QOI file, from its mapping when possible
+template<typename T, int C>
+inline bool load_qoi(const std::string& filename, Image<T,C>& image, const LoadOptions& options)
+{
+    const MappedFile mapping(filename);
+    if(mapping.valid())
+        return decode_qoi(mapping.data(), mapping.size(), image, options);
+
+    image.clear();
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if(file == nullptr)
+        return stb::stbi__err("can't fopen");
+    std::vector<unsigned char> bytes;
+    unsigned char chunk[65536];
+    std::size_t count = 0;
+    while((count = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+        bytes.insert(bytes.end(), chunk, chunk + count);
+    std::fclose(file);
+    return decode_qoi(bytes.data(), bytes.size(), image, options);
+}
+
+//!
+//! \brief Encode image as a QOI file of 3 or 4 channels, gray images getting
+//! the channels of RGB(A) images as by cast()
+//!
+//! The pixels are encoded in a single pass, rows of types other than unsigned
+//! char are converted to bytes one at a time right before.
+//!
+template<typename T, int C>
+inline bool encode_qoi(const Image<T,C>& image, const SaveOptions& options, std::vector<std::uint8_t>& qoi)
+{
+    if constexpr(C < 3)
+    {
+        Image<T,C + 2> color;
+        cast(image, color);
+        return encode_qoi(color, options, qoi);
+    }
+    else
+    {
+        qoi.clear();
+        const int height = image.height();
+        const int width  = image.width();
+        if(image.size() == 0)
+            return false;
+
+        // a pixel takes at most one byte more than its channels
+        qoi.resize(qoi_header + std::size_t(width) * height * (C + 1) + sizeof(qoi_end));
+        memcpy(qoi.data(), qoi_magic, 4);
+        qoi_write32(qoi.data() + 4, std::uint32_t(width));
+        qoi_write32(qoi.data() + 8, std::uint32_t(height));
+        qoi[12] = (unsigned char)(C);
+        qoi[13] = 0;
+
+        QoiEncoder encoder;
+        encoder.out = qoi.data() + qoi_header;
+        std::vector<unsigned char> row(std::is_same<T, unsigned char>::value ? 0 : std::size_t(width) * C);
+        for(int i = 0; i < height; ++i)
+        {
+            const int source = options.flip ? height - 1 - i : i;
+            const unsigned char* pixels;
+            if constexpr(std::is_same<T, unsigned char>::value)
+            {
+                pixels = image.raw() + std::size_t(C) * width * source;
+            }
+            else
+            {
+                convert_row<T,C>(const_cast<Image<T,C>*>(&image), source, row.data());
+                pixels = row.data();
+            }
+            encoder.encode<C>(pixels, width);
+        }
+        encoder.flush();
+        memcpy(encoder.out, qoi_end, sizeof(qoi_end));
+        qoi.resize(std::size_t(encoder.out - qoi.data()) + sizeof(qoi_end));
+        return true;
+    }
+}
+
+//! \brief Write image as a QOI file with a single write
+template<typename T, int C>
+inline bool save_qoi(const std::string& filename, const Image<T,C>& image, const SaveOptions& options)
+{
+    std::vector<std::uint8_t> qoi;
+    if(!encode_qoi(image, options, qoi))
+        return false;
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if(file == nullptr)
+        return false;
+    bool ok = std::fwrite(qoi.data(), 1, qoi.size(), file) == qoi.size();
+    ok = std::fclose(file) == 0 && ok;
+    if(!ok)
+        std::remove(filename.c_str());
+    return ok;
+}
+
+inline bool info_qoi(const std::string& filename, ImageInfo& image_info)
+{
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if(file == nullptr)
+        return stb::stbi__err("can't fopen");
+    unsigned char header[qoi_header];
+    const auto size = std::fread(header, 1, qoi_header, file);
+    std::fclose(file);
+    return qoi_info(header, size, image_info);
+}
+
+} // namespace internal
+
+template<typename T, int C>
+bool load(const std::string& filename, Image<T,C>& image, bool flip)
+{
+    LoadOptions options;
+    options.flip = flip;
+    return load(filename, image, options);
+}
+
+template<typename T, int C>
+bool load(const std::string& filename, Image<T,C>& image, const LoadOptions& options)
+{
+    const auto format = internal::file_format(filename);
+    if(format == internal::FileFormat::qoi)
+        return internal::load_qoi(filename, image, options);
+    if(format != internal::FileFormat::png)
+        return internal::load_pnm(filename, image, options);
+
+    // regular files are decoded straight from their mapping, without copies
+    // through stdio
+    const internal::MappedFile file(filename);
+    if(file.valid() && file.size() <= std::size_t(INT_MAX))
+        return decode(file.data(), file.size(), image, options);
+
+    const auto stb_options = internal::stb_options(options);
+    return internal::load_stb(image,
+        [&](int* width, int* height, int* channel, int desired_channels, int* bits)
+    {
+        return stb::stbi_load_with_options(filename.c_str(),
+                                           width,
+                                           height,
+                                           channel,
+                                           desired_channels,
+                                           bits,
+                                           &stb_options);
+    });
+}
+
+template<typename T, int C>
+bool save(const std::string& filename, const Image<T,C>& image, bool flip)
+{
+    SaveOptions options;
+    options.flip = flip;
+    return save(filename, image, options);
+}
+
+template<typename T, int C>
+bool save(const std::string& filename, const Image<T,C>& image, const SaveOptions& options)
+{
+    const auto format = internal::file_format(filename);
+    if(format == internal::FileFormat::qoi)
+        return internal::save_qoi(filename, image, options);
+    if(format != internal::FileFormat::png)
+        return internal::save_pnm(filename, image, options, format);
+
+    // the file is written as rows are compressed
+    const auto stb_options = internal::stb_options(options);
+    const auto ok = stb::stbi_write_png_rows(filename.c_str(),
+                                             image.width(),
+                                             image.height(),
+                                             image.depth(),
+                                             internal::row_converter<T,C>(options),
+                                             const_cast<Image<T,C>*>(&image),
+                                             &stb_options);
+
+    return ok;
+}
+
+template<typename T, int C>
+bool decode(const void* data, std::size_t size, Image<T,C>& image, const LoadOptions& options)
+{
+    const auto bytes = static_cast<const unsigned char*>(data);
+    if(size >= 4 && memcmp(bytes, internal::qoi_magic, 4) == 0)
+        return internal::decode_qoi(bytes, size, image, options);
+
+    if(size > std::size_t(INT_MAX))
+    {
+        image.clear();
+        return false;
+    }
+
+    const auto stb_options = internal::stb_options(options);
+    return internal::load_stb(image,
+        [&](int* width, int* height, int* channel, int desired_channels, int* bits)
+    {
+        return stb::stbi_load_from_memory_with_options(
+                    static_cast<const stb::stbi_uc*>(data),
+                    int(size),
+                    width,
+                    height,
+                    channel,
+                    desired_channels,
+                    bits,
+                    &stb_options);
+    });
+}
+
+template<typename T, int C>
+std::vector<std::uint8_t> encode(const Image<T,C>& image, const SaveOptions& options)
+{
+    if(options.qoi)
+    {
+        std::vector<std::uint8_t> qoi;
+        internal::encode_qoi(image, options, qoi);
+        return qoi;
+    }
+
+    std::vector<std::uint8_t> png;
+    const auto append = [&png](const void* data, std::size_t size)
+    {
+        const auto bytes = static_cast<const std::uint8_t*>(data);
+        png.insert(png.end(), bytes, bytes + size);
+    };
+    if(!encode(image, append, options))
+        png.clear();
+    return png;
+}
+
+template<typename T, int C>
+bool encode(const Image<T,C>& image,
+            const std::function<void(const void*, std::size_t)>& sink,
+            const SaveOptions& options)
+{
+    if(options.qoi)
+    {
+        std::vector<std::uint8_t> qoi;
+        if(!internal::encode_qoi(image, options, qoi))
+            return false;
+        sink(qoi.data(), qoi.size());
+        return true;
+    }
+
+    const auto write = [](void* context, void* data, int size)
+    {
+        const auto& sink = *static_cast<const std::function<void(const void*, std::size_t)>*>(context);
+        sink(data, std::size_t(size));
+    };
+
+    const auto stb_options = internal::stb_options(options);
+    const auto ok = stb::stbi_write_png_rows_to_func(write,
+                                                     const_cast<std::function<void(const void*, std::size_t)>*>(&sink),
+                                                     image.width(),
+                                                     image.height(),
+                                                     image.depth(),
+                                                     internal::row_converter<T,C>(options),
+                                                     const_cast<Image<T,C>*>(&image),
+                                                     &stb_options);
+
+    return ok;
+}
+
+inline bool info(const std::string& filename, ImageInfo& image_info)
+{
+    image_info = ImageInfo();
+    const auto format = internal::file_format(filename);
+    if(format == internal::FileFormat::qoi)
+        return internal::info_qoi(filename, image_info);
+    if(format != internal::FileFormat::png)
+        return internal::info_pnm(filename, image_info);
+    return stb::stbi_info_with_bits(filename.c_str(),
+                                    &image_info.width,
+                                    &image_info.height,
+                                    &image_info.channels,
+                                    &image_info.bits);
+}
+
+inline bool info(const void* data, std::size_t size, ImageInfo& image_info)
+{
+    image_info = ImageInfo();
+    const auto bytes = static_cast<const unsigned char*>(data);
+    if(size >= 4 && memcmp(bytes, internal::qoi_magic, 4) == 0)
+        return internal::qoi_info(bytes, size, image_info);
+    if(size > std::size_t(INT_MAX))
+        return false;
+    return stb::stbi_info_from_memory_with_bits(static_cast<const stb::stbi_uc*>(data),
+                                                int(size),
+                                                &image_info.width,
+                                                &image_info.height,
+                                                &image_info.channels,
+                                                &image_info.bits);
+}
+
+inline const char* failure_reason()
+{
+    return stb::stbi_failure_reason();
+}
+
+// Image -----------------------------------------------------------------------
+
+template<typename T, int C>
+Image<T,C>::Image() : Image(0, 0)
+{
+}
+
+template<typename T, int C>
+Image<T,C>::Image(int height, int width) :
+    m_height(height),
+    m_width(width),
+    m_data(C * width * height)
+{
+}
+
+//!
+//! \brief used for io operations
+//! \warning data must point to an array of size height*size*depth
+//!
+template<typename T, int C>
+Image<T,C>::Image(int height, int width, unsigned char* data, int depth) : Image(height, width)
+{
+    internal::cast_pixels(data, depth, *this);
+}
+
+//!
+//! \brief used for io operations
+//! \warning data must point to an array of size height*size*C
+//!
+template<typename T, int C>
+Image<T,C>::Image(int height, int width, unsigned char* data) : Image(height, width)
+{
+    internal::cast_pixels<C>(data, *this);
+}
+
+template<typename T, int C>
+template<typename T2, int C2>
+Image<T,C>::Image(const Image<T2,C2>& other)  :
+    m_height(other.height()),
+    m_width(other.width()),
+    m_data(C * other.width() * other.height())
+{
+    img::cast(other, *this);
+}
+
+template<typename T, int C>
+template<typename T2, int C2>
+Image<T,C>& Image<T,C>::operator=(const Image<T2,C2>& other)
+{
+    img::cast(other, *this);
+    return *this;
+}
+
+// Cast ------------------------------------------------------------------------
+
+template<typename T, int C>
+template<class Image2>
+Image2 Image<T,C>::cast() const
+{
+    return Image2(*this);
+}
+
+template<typename T, int C>
+template<typename T2, int C2>
+Image<T2,C2> Image<T,C>::cast() const
+{
+    return Image<T2,C2>(*this);
+}
+
+// Capacity --------------------------------------------------------------------
+
+template<typename T, int C>
+bool Image<T,C>::empty()
+{
+    return m_data.empty();
+}
+
+template<typename T, int C>
+int Image<T,C>::height() const
+{
+    return m_height;
+}
+
+template<typename T, int C>
+int Image<T,C>::width() const
+{
+    return m_width;
+}
+
+template<typename T, int C>
+constexpr int Image<T,C>::depth()
+{
+    return C;
+}
+
+template<typename T, int C>
+int Image<T,C>::size() const
+{
+    return m_height * m_width;
+}
+
+template<typename T, int C>
+int Image<T,C>::capacity() const
+{
+    return m_height * m_width * C;
+}
+
+template<typename T, int C>
+int Image<T,C>::rows() const
+{
+    return m_height;
+}
+
+template<typename T, int C>
+int Image<T,C>::cols() const
+{
+    return m_width;
+}
+
+// Accessors -------------------------------------------------------------------
+
+template<typename T, int C>
+typename Image<T,C>::ColorAccess Image<T,C>::operator()(int i, int j)
+{
+    if constexpr(C == 1)
+        return *at(i,j);
+    else
+        return ColorAccess(at(i,j));
+}
+
+template<typename T, int C>
+typename Image<T,C>::ConstColorAccess Image<T,C>::operator()(int i, int j) const
+{
+    if constexpr(C == 1)
+        return *at(i,j);
+    else
+        return ConstColorAccess(at(i,j));
+}
+
+template<typename T, int C>
+typename Image<T,C>::ColorAccess Image<T,C>::operator()(int k)
+{
+    if constexpr(C == 1)
+        return *at(k);
+    else
+        return ColorAccess(at(k));
+}
+
+template<typename T, int C>
+typename Image<T,C>::ConstColorAccess Image<T,C>::operator()(int k) const
+{
+    if constexpr(C == 1)
+        return *at(k);
+    else
+        return ConstColorAccess(at(k));
+}
+
+template<typename T, int C>
+const std::vector<T>& Image<T,C>::data() const
+{
+    return m_data;
+}
+
+template<typename T, int C>
+std::vector<T>& Image<T,C>::data()
+{
+    return m_data;
 }
 
 template<typename T, int C>
@@ -1051,6 +2955,12 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void
 STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 // for stbi_load_from_file, file pointer is left pointing immediately after image
 
+// stbi_load_options is declared along with the io functions of img. the
+// *_with_options functions return 8-bit channels if bits_per_channel is NULL,
+// otherwise the channels of the file, 8 or 16 bits as stored in bits_per_channel
+STBIDEF void *stbi_load_with_options(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int *bits_per_channel, stbi_load_options const *options);
+STBIDEF void *stbi_load_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, int *bits_per_channel, stbi_load_options const *options);
+
 ////////////////////////////////////
 //
 // 16-bits-per-channel interface
@@ -1062,8 +2972,7 @@ STBIDEF stbi_us *stbi_load_16_from_callbacks(stbi_io_callbacks const *clbk, void
 STBIDEF stbi_us *stbi_load_16          (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels);
 STBIDEF stbi_us *stbi_load_from_file_16(FILE *f, int *x, int *y, int *channels_in_file, int desired_channels);
 
-// get a VERY brief reason for failure
-// NOT THREADSAFE
+// get a VERY brief reason for the last failure on the calling thread
 STBIDEF const char *stbi_failure_reason  (void);
 
 // free the loaded image -- this is just free()
@@ -1080,6 +2989,10 @@ STBIDEF int      stbi_info_from_file     (FILE *f,                  int *x, int
 STBIDEF int      stbi_is_16_bit          (char const *filename);
 STBIDEF int      stbi_is_16_bit_from_file(FILE *f);
 
+// stbi_info with the bits per channel of the decoded pixels, 8 or 16, in one read
+STBIDEF int      stbi_info_with_bits            (char const *filename,                int *x, int *y, int *comp, int *bits_per_channel);
+STBIDEF int      stbi_info_from_memory_with_bits(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *bits_per_channel);
+
 // for image formats that explicitly notate that they have premultiplied alpha,
 // we just return the colors as stored in the file. set this flag to force
 // unpremultiplication. results are undefined if the unpremultiply overflow.
@@ -1101,6 +3014,20 @@ STBIDEF int   stbi_zlib_decode_buffer(char *obuffer, int olen, const char *ibuff
 
 STBIDEF char *stbi_zlib_decode_noheader_malloc(const char *buffer, int len, int *outlen);
 STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen);
+
+// PNG streaming - decodes the rows of a non-interlaced, non-iPhone PNG from top
+// to bottom as the file is read, holding a few rows and the zlib window instead
+// of the whole image. rows have the channels of the file, with an alpha channel
+// added by a tRNS chunk, in 8 bits or native 16 bits for 16-bit PNGs.
+// stbi_png_stream_open fails with flip_vertically
+
+typedef struct stbi_png_stream stbi_png_stream;
+
+STBIDEF stbi_png_stream *stbi_png_stream_open(char const *filename, stbi_load_options const *options);
+STBIDEF void stbi_png_stream_info (stbi_png_stream const *stream, int *x, int *y, int *comp, int *bits_per_channel);
+// decodes up to count rows, returns the number decoded, fewer at the bottom of the image or on failure
+STBIDEF int  stbi_png_stream_rows (stbi_png_stream *stream, void *rows, int count);
+STBIDEF void stbi_png_stream_close(stbi_png_stream *stream);
 //
 //
 ////   end header file   /////////////////////////////////////////////////////
@@ -1274,14 +3201,29 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   stbi_load_options options;
 } stbi__context;
 
+// defaults of the options, per thread
+static thread_local int stbi__vertically_flip_on_load = 0;
+static thread_local int stbi__unpremultiply_on_load = 0;
+static thread_local int stbi__de_iphone_flag = 0;
+
+static void stbi__default_options(stbi__context *s)
+{
+   s->options.flip_vertically = stbi__vertically_flip_on_load;
+   s->options.unpremultiply = stbi__unpremultiply_on_load;
+   s->options.convert_iphone_png_to_rgb = stbi__de_iphone_flag;
+   s->options.verify_checksums = 0;
+}
 
 static void stbi__refill_buffer(stbi__context *s);
 
 // initialize a memory-decode context
 static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 {
+   stbi__default_options(s);
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
@@ -1291,6 +3233,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 // initialize a callback-based context
 static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *user)
 {
+   stbi__default_options(s);
    s->io = *c;
    s->io_user_data = user;
    s->buflen = sizeof(s->buffer_start);
@@ -1356,8 +3299,7 @@ static void    *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
 static int      stbi__png_is16(stbi__context *s);
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+static thread_local const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -1453,8 +3395,6 @@ STBIDEF void stbi_image_free(void *retval_from_stbi_load)
    STBI_FREE(retval_from_stbi_load);
 }
 
-static int stbi__vertically_flip_on_load = 0;
-
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
     stbi__vertically_flip_on_load = flag_true_if_should_flip;
@@ -1544,7 +3484,7 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->options.flip_vertically) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1569,7 +3509,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->options.flip_vertically) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1577,6 +3517,28 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    return (stbi__uint16 *) result;
 }
 
+// keeps 16-bit images at 16 bits when bits_per_channel is not NULL
+static void *stbi__load_and_postprocess_native(stbi__context *s, int *x, int *y, int *comp, int req_comp, int *bits_per_channel)
+{
+   stbi__result_info ri;
+   void *result;
+
+   if (!bits_per_channel)
+      return stbi__load_and_postprocess_8bit(s,x,y,comp,req_comp);
+
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   if (result == NULL)
+      return NULL;
+
+   if (s->options.flip_vertically) {
+      int channels = req_comp ? req_comp : *comp;
+      stbi__vertical_flip(result, *x, *y, channels * (ri.bits_per_channel / 8));
+   }
+
+   *bits_per_channel = ri.bits_per_channel;
+   return result;
+}
+
 static FILE *stbi__fopen(char const *filename, char const *mode)
 {
    FILE *f;
@@ -1600,6 +3562,19 @@ STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int
    return result;
 }
 
+STBIDEF void *stbi_load_with_options(char const *filename, int *x, int *y, int *comp, int req_comp, int *bits_per_channel, stbi_load_options const *options)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   void *result;
+   stbi__context s;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   if (options) s.options = *options;
+   result = stbi__load_and_postprocess_native(&s,x,y,comp,req_comp,bits_per_channel);
+   fclose(f);
+   return result;
+}
+
 STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    unsigned char *result;
@@ -1657,6 +3632,14 @@ STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, i
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF void *stbi_load_from_memory_with_options(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int *bits_per_channel, stbi_load_options const *options)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   if (options) s.options = *options;
+   return stbi__load_and_postprocess_native(&s,x,y,comp,req_comp,bits_per_channel);
+}
+
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
    stbi__context s;
@@ -1679,7 +3662,8 @@ enum
 {
    STBI__SCAN_load=0,
    STBI__SCAN_type,
-   STBI__SCAN_header
+   STBI__SCAN_header,
+   STBI__SCAN_stream   // stop at the first IDAT chunk, see stbi_png_stream
 };
 
 static void stbi__refill_buffer(stbi__context *s)
@@ -1887,21 +3871,214 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
 
 //#ifndef STBI_NO_ZLIB
 
-// fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
-#define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
+// checksums of the zlib streams and png chunks, also used by the writer.
+// crc-32 folds 64 bytes at a time with carry-less multiplications when the cpu
+// has them (checked at runtime) and otherwise goes by slices of 8 bytes
+
+static const stbi__uint32 stbi__crc_table[256] =
+{
+      0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+      0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+      0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+      0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+      0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+      0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+      0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+      0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+      0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+      0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+      0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+      0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+      0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+      0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+      0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+      0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+      0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+      0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+      0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+      0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+      0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+      0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+      0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+      0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+      0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+      0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+      0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+      0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+      0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+      0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+      0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+      0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
 
-// zlib-style huffman encoding
-// (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   stbi__uint16 fast[1 << STBI__ZFAST_BITS];
-   stbi__uint16 firstcode[16];
-   int maxcode[17];
-   stbi__uint16 firstsymbol[16];
-   stbi_uc  size[288];
-   stbi__uint16 value[288];
-} stbi__zhuffman;
+   stbi__uint32 t[8][256]; // t[k][b]: crc of byte b followed by k zero bytes
+} stbi__crc_slices;
+
+static stbi__crc_slices stbi__crc_make_slices(void)
+{
+   stbi__crc_slices s;
+   int i, k;
+   for (i=0; i < 256; ++i) {
+      s.t[0][i] = stbi__crc_table[i];
+      for (k=1; k < 8; ++k)
+         s.t[k][i] = (s.t[k-1][i] >> 8) ^ stbi__crc_table[s.t[k-1][i] & 0xff];
+   }
+   return s;
+}
+
+#ifdef IMG_TARGET_PCLMUL
+static int stbi__pclmul_available(void)
+{
+   static const int available = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+   return available;
+}
+
+// crc of len bytes, len >= 64 and a multiple of 16, from the inverted crc so far,
+// by folding with the constants of Intel's white paper "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction", as zlib does
+IMG_TARGET_PCLMUL static stbi__uint32 stbi__crc32_pclmul(const stbi_uc *buf, size_t len, stbi__uint32 crc)
+{
+   static const unsigned long long k1k2[2] = { 0x0154442bd4ull, 0x01c6e41596ull };
+   static const unsigned long long k3k4[2] = { 0x01751997d0ull, 0x00ccaa009eull };
+   static const unsigned long long k5k0[2] = { 0x0163cd6124ull, 0x0000000000ull };
+   static const unsigned long long poly[2] = { 0x01db710641ull, 0x01f7011641ull };
+   __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+   x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (buf + 0x00)), _mm_cvtsi32_si128((int) crc));
+   x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+   x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+   x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+   x0 = _mm_loadu_si128((const __m128i *) k1k2);
+   buf += 64;
+   len -= 64;
+
+   // fold 4 x 128 bits
+   while (len >= 64) {
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) (buf + 0x00)));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (buf + 0x10)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (buf + 0x20)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (buf + 0x30)));
+      buf += 64;
+      len -= 64;
+   }
+
+   // fold into 128 bits, then the remaining blocks of 16 bytes
+   x0 = _mm_loadu_si128((const __m128i *) k3k4);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+   x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+   x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+   while (len >= 16) {
+      x2 = _mm_loadu_si128((const __m128i *) buf);
+      x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+      buf += 16;
+      len -= 16;
+   }
+
+   // fold 128 bits to 64 bits
+   x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+   x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+   x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+   x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+   x2 = _mm_srli_si128(x1, 4);
+   x1 = _mm_and_si128(x1, x3);
+   x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+
+   // barrett reduction to 32 bits
+   x0 = _mm_loadu_si128((const __m128i *) poly);
+   x2 = _mm_and_si128(x1, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+   x2 = _mm_and_si128(x2, x3);
+   x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+   x1 = _mm_xor_si128(x1, x2);
+   return (stbi__uint32) _mm_extract_epi32(x1, 1);
+}
+#endif
+
+// crc-32 of the len bytes of buf following data whose crc-32 is crc (0 at start)
+static stbi__uint32 stbi__crc32(stbi__uint32 crc, const stbi_uc *buf, size_t len)
+{
+   static const stbi__crc_slices slices = stbi__crc_make_slices();
+   const stbi__uint32 (*t)[256] = slices.t;
+   crc = ~crc;
+#ifdef IMG_TARGET_PCLMUL
+   if (len >= 64 && stbi__pclmul_available()) {
+      size_t n = len & ~(size_t) 15;
+      crc = stbi__crc32_pclmul(buf, n, crc);
+      buf += n;
+      len -= n;
+   }
+#endif
+   while (len >= 8) {
+      stbi__uint32 a = crc ^ (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((stbi__uint32) buf[3] << 24));
+      stbi__uint32 b = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((stbi__uint32) buf[7] << 24);
+      crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^ t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+            t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^ t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+      buf += 8;
+      len -= 8;
+   }
+   while (len--)
+      crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+   return ~crc;
+}
+
+// adler-32 of the len bytes of buf following data whose adler-32 is adler (1 at
+// start). sums are reduced every 5552 bytes, the most that cannot overflow
+static stbi__uint32 stbi__adler32(stbi__uint32 adler, const stbi_uc *buf, size_t len)
+{
+   stbi__uint32 s1 = adler & 0xffff, s2 = adler >> 16;
+   while (len > 0) {
+      size_t n = len < 5552 ? len : 5552, i = 0;
+#ifdef IMG_SSE2
+      if (n >= 16) {
+         // per block of 16 bytes: s1 += sum of the bytes, s2 += 16 * s1 before the
+         // block + the bytes weighted 16 down to 1; all sums stay below 2^32
+         const __m128i zero = _mm_setzero_si128();
+         const __m128i w_lo = _mm_setr_epi16(16,15,14,13,12,11,10,9);
+         const __m128i w_hi = _mm_setr_epi16(8,7,6,5,4,3,2,1);
+         __m128i v1 = zero, v2 = zero, vp = zero;
+         stbi__uint32 l1[4], l2[4], lp[4];
+         size_t blocks = n / 16;
+         for (; i < blocks * 16; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *) (buf + i));
+            vp = _mm_add_epi32(vp, v1);
+            v1 = _mm_add_epi32(v1, _mm_sad_epu8(x, zero));
+            v2 = _mm_add_epi32(v2, _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(x, zero), w_lo),
+                                                 _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), w_hi)));
+         }
+         _mm_storeu_si128((__m128i *) l1, v1);
+         _mm_storeu_si128((__m128i *) l2, v2);
+         _mm_storeu_si128((__m128i *) lp, vp);
+         s2 += s1 * (stbi__uint32) (blocks * 16) + 16 * (lp[0] + lp[1] + lp[2] + lp[3]) + l2[0] + l2[1] + l2[2] + l2[3];
+         s1 += l1[0] + l1[1] + l1[2] + l1[3];
+      }
+#endif
+      for (; i < n; ++i) { s1 += buf[i]; s2 += s1; }
+      s1 %= 65521;
+      s2 %= 65521;
+      buf += n;
+      len -= n;
+   }
+   return (s2 << 16) | s1;
+}
 
 stbi_inline static int stbi__bitreverse16(int n)
 {
@@ -1920,14 +4097,90 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
    return stbi__bitreverse16(v) >> (16-bits);
 }
 
-static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
+// zlib-style huffman decoding, with libdeflate-style tables: the first
+// 1 << STBI__ZLENGTH_BITS entries resolve all codes of up to that many bits
+// from the low bits of the bit buffer, and point to subtables for the longer
+// ones. Each entry holds in its bits
+//    0..4   bits to consume
+//    5..7   kind of the entry
+//    8..11  extra bits following the code, or bits resolved by the subtable
+//    16..31 value
+// A length or distance code whose extra bits fit in the table is resolved with
+// them, and two literals whose codes fit together are resolved at once.
+#define STBI__ZLENGTH_BITS    11
+#define STBI__ZLENGTH_ENOUGH  2342 // largest table of 288 codes of up to 15 bits, as in zlib's enough.c
+#define STBI__ZDIST_BITS      8
+#define STBI__ZDIST_ENOUGH    402  // largest table of 32 codes of up to 15 bits
+#define STBI__ZCODE_BITS      7    // code lengths codes are at most 7 bits long, no subtable
+
+#define STBI__ZE_LITERAL  (1 << 5) // value is a literal
+#define STBI__ZE_LITERAL2 (2 << 5) // value holds two literals, the first in its low byte
+#define STBI__ZE_VALUE    (3 << 5) // value is a length or distance, extra bits included
+#define STBI__ZE_BASE     (4 << 5) // value is the base of a length or distance followed by extra bits
+#define STBI__ZE_END      (5 << 5) // end of block
+#define STBI__ZE_TABLE    (6 << 5) // value is the offset of a subtable
+#define STBI__ZE_KIND     (7 << 5) // 0 for an invalid code
+
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+enum
+{
+   STBI__ZTABLE_LENGTH,
+   STBI__ZTABLE_DIST,
+   STBI__ZTABLE_CODE
+};
+
+// table entry of symbol s, without its bits to consume
+static stbi__uint32 stbi__zsymbol(int type, int s)
+{
+   if (type == STBI__ZTABLE_CODE || (type == STBI__ZTABLE_LENGTH && s < 256))
+      return STBI__ZE_LITERAL | ((stbi__uint32) s << 16);
+   if (type == STBI__ZTABLE_LENGTH) {
+      if (s == 256) return STBI__ZE_END;
+      if (s > 285) return 0;
+      s -= 257;
+      return STBI__ZE_BASE | (stbi__zlength_extra[s] << 8) | ((stbi__uint32) stbi__zlength_base[s] << 16);
+   }
+   if (s > 29) return 0;
+   return STBI__ZE_BASE | (stbi__zdist_extra[s] << 8) | ((stbi__uint32) stbi__zdist_base[s] << 16);
+}
+
+// fills the entries of the code rev of len bits in a table of 1 << bits entries
+static void stbi__zfill(stbi__uint32 *table, int bits, int rev, int len, stbi__uint32 e)
+{
+   int i, v, extra = (e >> 8) & 15;
+   if ((e & STBI__ZE_KIND) == STBI__ZE_BASE && len + extra <= bits) {
+      for (v=0; v < (1 << extra); ++v)
+         for (i = rev | (v << len); i < (1 << bits); i += 1 << (len + extra))
+            table[i] = STBI__ZE_VALUE | (len + extra) | (((e >> 16) + v) << 16);
+   } else {
+      for (i = rev; i < (1 << bits); i += 1 << len)
+         table[i] = e | len;
+   }
+}
+
+static int stbi__zbuild_table(stbi__uint32 *table, int bits, int enough, const stbi_uc *sizelist, int num, int type)
 {
-   int i,k=0;
-   int code, next_code[16], sizes[17];
+   int i,j,k,len,code;
+   int sizes[17], first[17], left[17];
+   int low = -1, sub = 0, subbits = 0, next = 1 << bits, maxlen = 0;
+   stbi__uint16 sorted[288];
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 0, sizeof(z->fast));
+   memset(table, 0, sizeof(*table) << bits);
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
@@ -1935,33 +4188,66 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
       if (sizes[i] > (1 << i))
          return stbi__err("bad sizes", "Corrupt PNG");
    code = 0;
+   k = 0;
    for (i=1; i < 16; ++i) {
-      next_code[i] = code;
-      z->firstcode[i] = (stbi__uint16) code;
-      z->firstsymbol[i] = (stbi__uint16) k;
+      first[i] = k;
+      left[i] = sizes[i];
       code = (code + sizes[i]);
-      if (sizes[i])
+      if (sizes[i]) {
          if (code-1 >= (1 << i)) return stbi__err("bad codelengths","Corrupt PNG");
-      z->maxcode[i] = code << (16-i); // preshift for inner loop
+         maxlen = i;
+      }
       code <<= 1;
       k += sizes[i];
    }
-   z->maxcode[16] = 0x10000; // sentinel
-   for (i=0; i < num; ++i) {
-      int s = sizelist[i];
-      if (s) {
-         int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-         stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
-         z->size [c] = (stbi_uc     ) s;
-         z->value[c] = (stbi__uint16) i;
-         if (s <= STBI__ZFAST_BITS) {
-            int j = stbi__bit_reverse(next_code[s],s);
-            while (j < (1 << STBI__ZFAST_BITS)) {
-               z->fast[j] = fastv;
-               j += (1 << s);
+   // symbols in canonical order, by length then value
+   for (i=0; i < num; ++i)
+      if (sizelist[i])
+         sorted[first[sizelist[i]]++] = (stbi__uint16) i;
+
+   code = 0;
+   k = 0;
+   for (len=1; len < 16; ++len, code <<= 1) {
+      for (j=0; j < sizes[len]; ++j, ++code) {
+         stbi__uint32 e = stbi__zsymbol(type, sorted[k++]);
+         int rev = stbi__bit_reverse(code, len);
+         if (len <= bits) {
+            stbi__zfill(table, bits, rev, len, e);
+         } else {
+            if ((rev & ((1 << bits) - 1)) != low) {
+               // first code of a new prefix: its subtable is sized, as in zlib, to
+               // hold all the remaining codes sharing the prefix
+               int avail = 1 << (len - bits);
+               subbits = len - bits;
+               while (subbits + bits < maxlen) {
+                  avail -= left[subbits + bits];
+                  if (avail <= 0) break;
+                  ++subbits;
+                  avail <<= 1;
+               }
+               if (next + (1 << subbits) > enough) return stbi__err("bad codelengths","Corrupt PNG");
+               memset(table + next, 0, sizeof(*table) << subbits);
+               low = rev & ((1 << bits) - 1);
+               sub = next;
+               next += 1 << subbits;
+               table[low] = STBI__ZE_TABLE | bits | (subbits << 8) | ((stbi__uint32) sub << 16);
             }
+            stbi__zfill(table + sub, subbits, rev >> bits, len - bits, e);
          }
-         ++next_code[s];
+         --left[len];
+      }
+   }
+
+   if (type == STBI__ZTABLE_LENGTH) {
+      // pair the literals whose codes fit together in the first table, going
+      // down so that the entry of the second one is still a single literal
+      for (i = (1 << bits) - 1; i >= 0; --i) {
+         stbi__uint32 e = table[i], e2;
+         int s = e & 31;
+         if ((e & STBI__ZE_KIND) != STBI__ZE_LITERAL) continue;
+         e2 = table[i >> s];
+         if ((e2 & STBI__ZE_KIND) != STBI__ZE_LITERAL || s + (int) (e2 & 31) > bits) continue;
+         table[i] = STBI__ZE_LITERAL2 | (s + (e2 & 31)) | (e & 0xff0000) | ((e2 & 0xff0000) << 8);
       }
    }
    return 1;
@@ -1977,71 +4263,87 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   unsigned long long code_buffer; // bits above num_bits are the next input bits or zeros
+   int zeros;                      // bytes read past zbuffer_end, as zeros
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
-   stbi__zhuffman z_length, z_distance;
+   // when z_pausable, a huffman block stops between two symbols once zout
+   // passes zout_pause or zbuffer passes zbuffer_pause, to be resumed later
+   int   z_pausable;
+   char *zout_pause;
+   stbi_uc *zbuffer_pause;
+
+   stbi__uint32 z_length[STBI__ZLENGTH_ENOUGH], z_distance[STBI__ZDIST_ENOUGH];
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (z->zbuffer >= z->zbuffer_end) { ++z->zeros; return 0; }
    return *z->zbuffer++;
 }
 
+stbi_inline static unsigned long long stbi__zload64(const stbi_uc *p)
+{
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   unsigned long long v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   int i;
+   unsigned long long v = 0;
+   for (i=7; i >= 0; --i) v = (v << 8) | p[i];
+   return v;
+#endif
+}
+
+// tops the bit buffer up to at least 56 bits, a word at a time while 8 input
+// bytes remain; the bytes of the word beyond the last whole one consumed land
+// above num_bits, where the next refill puts them again
+stbi_inline static void stbi__zrefill(stbi__zbuf *z, stbi_uc **in, unsigned long long *buf, int *n)
+{
+   if (z->zbuffer_end - *in >= 8) {
+      *buf |= stbi__zload64(*in) << *n;
+      *in += (63 - *n) >> 3;
+      *n |= 56;
+   } else {
+      z->zbuffer = *in;
+      do {
+         *buf |= (unsigned long long) stbi__zget8(z) << *n;
+         *n += 8;
+      } while (*n <= 56);
+      *in = z->zbuffer;
+   }
+}
+
 static void stbi__fill_bits(stbi__zbuf *z)
 {
-   do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   stbi__zrefill(z, &z->zbuffer, &z->code_buffer, &z->num_bits);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1u << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
-{
-   int b,s,k;
-   // not resolved by fast table, so compute it the slow way
-   // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
-   for (s=STBI__ZFAST_BITS+1; ; ++s)
-      if (k < z->maxcode[s])
-         break;
-   if (s == 16) return -1; // invalid code!
-   // code size is s, so:
-   b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
-   STBI_ASSERT(z->size[b] == s);
-   a->code_buffer >>= s;
-   a->num_bits -= s;
-   return z->value[b];
-}
-
-stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
+// entry of the next code in table, consuming the bits of a subtable entry
+stbi_inline static stbi__uint32 stbi__zlookup(const stbi__uint32 *table, int bits, unsigned long long *buf, int *n)
 {
-   int b,s;
-   if (a->num_bits < 16) stbi__fill_bits(a);
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
-   if (b) {
-      s = b >> 9;
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return b & 511;
+   stbi__uint32 e = table[*buf & ((1u << bits) - 1)];
+   if ((e & STBI__ZE_KIND) == STBI__ZE_TABLE) {
+      *buf >>= bits;
+      *n -= bits;
+      e = table[(e >> 16) + (*buf & ((1u << ((e >> 8) & 15)) - 1))];
    }
-   return stbi__zhuffman_decode_slowpath(a, z);
+   return e;
 }
 
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
@@ -2063,58 +4365,102 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
-
+// the bit buffer holds at least 56 bits after a refill, enough for a length
+// code with its extra bits (15+5) and a distance code with its (15+13).
+// returns 1 at the end of the block, 2 when paused
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
+   stbi_uc *in = a->zbuffer;
+   unsigned long long buf = a->code_buffer;
+   int n = a->num_bits;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      stbi__uint32 e;
+      int len,dist;
+      char *p;
+      if (a->z_pausable && (zout > a->zout_pause || in > a->zbuffer_pause)) {
+         a->zout = zout;
+         a->zbuffer = in;
+         a->code_buffer = buf;
+         a->num_bits = n;
+         return 2;
+      }
+      if (n < 56) {
+         stbi__zrefill(a, &in, &buf, &n);
+         // the bit buffer holds 8 bytes, more zeros than that were consumed
+         if (a->zeros > 8) return stbi__err("unexpected end","Corrupt PNG");
+      }
+      e = stbi__zlookup(a->z_length, STBI__ZLENGTH_BITS, &buf, &n);
+      buf >>= e & 31;
+      n -= e & 31;
+      switch (e & STBI__ZE_KIND) {
+      case STBI__ZE_LITERAL:
          if (zout >= a->zout_end) {
             if (!stbi__zexpand(a, zout, 1)) return 0;
             zout = a->zout;
          }
-         *zout++ = (char) z;
-      } else {
-         stbi_uc *p;
-         int len,dist;
-         if (z == 256) {
-            a->zout = zout;
-            return 1;
-         }
-         z -= 257;
-         len = stbi__zlength_base[z];
-         if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-         z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
-         dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
-         if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
-         if (zout + len > a->zout_end) {
-            if (!stbi__zexpand(a, zout, len)) return 0;
+         *zout++ = (char) (e >> 16);
+         continue;
+      case STBI__ZE_LITERAL2:
+         if (a->zout_end - zout < 2) {
+            if (!stbi__zexpand(a, zout, 2)) return 0;
             zout = a->zout;
          }
-         p = (stbi_uc *) (zout - dist);
-         if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
-         } else {
-            if (len) { do *zout++ = *p++; while (--len); }
-         }
+         zout[0] = (char) (e >> 16);
+         zout[1] = (char) (e >> 24);
+         zout += 2;
+         continue;
+      case STBI__ZE_VALUE:
+         len = (int) (e >> 16);
+         break;
+      case STBI__ZE_BASE:
+         len = (int) (e >> 16) + (int) (buf & ((1u << ((e >> 8) & 15)) - 1));
+         buf >>= (e >> 8) & 15;
+         n -= (e >> 8) & 15;
+         break;
+      case STBI__ZE_END:
+         a->zout = zout;
+         a->zbuffer = in;
+         a->code_buffer = buf;
+         a->num_bits = n;
+         return 1;
+      default:
+         return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      }
+
+      e = stbi__zlookup(a->z_distance, STBI__ZDIST_BITS, &buf, &n);
+      buf >>= e & 31;
+      n -= e & 31;
+      if ((e & STBI__ZE_KIND) == STBI__ZE_VALUE) {
+         dist = (int) (e >> 16);
+      } else if ((e & STBI__ZE_KIND) == STBI__ZE_BASE) {
+         dist = (int) (e >> 16) + (int) (buf & ((1u << ((e >> 8) & 15)) - 1));
+         buf >>= (e >> 8) & 15;
+         n -= (e >> 8) & 15;
+      } else {
+         return stbi__err("bad huffman code","Corrupt PNG");
+      }
+      if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+      if (a->zout_end - zout < len) {
+         if (!stbi__zexpand(a, zout, len)) return 0;
+         zout = a->zout;
+      }
+      p = zout - dist;
+      if (dist == 1) { // run of one byte; common in images.
+         memset(zout, *p, len);
+         zout += len;
+      } else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+         // words of 8 bytes, which never overlap their source, the last one
+         // running past the match into the slack of the buffer
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
+      } else {
+         do *zout++ = *p++; while (--len);
       }
    }
 }
@@ -2122,7 +4468,7 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
 static int stbi__compute_huffman_codes(stbi__zbuf *a)
 {
    static const stbi_uc length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   stbi__zhuffman z_codelength;
+   stbi__uint32 z_codelength[1 << STBI__ZCODE_BITS];
    stbi_uc lencodes[286+32+137];//padding for maximum single op
    stbi_uc codelength_sizes[19];
    int i,n;
@@ -2137,12 +4483,18 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       int s = stbi__zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (stbi_uc) s;
    }
-   if (!stbi__zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!stbi__zbuild_table(z_codelength, STBI__ZCODE_BITS, 1 << STBI__ZCODE_BITS, codelength_sizes, 19, STBI__ZTABLE_CODE)) return 0;
 
    n = 0;
    while (n < ntot) {
-      int c = stbi__zhuffman_decode(a, &z_codelength);
-      if (c < 0 || c >= 19) return stbi__err("bad codelengths", "Corrupt PNG");
+      stbi__uint32 e;
+      int c;
+      if (a->num_bits < 16) stbi__fill_bits(a);
+      e = z_codelength[a->code_buffer & ((1 << STBI__ZCODE_BITS) - 1)];
+      if (!e) return stbi__err("bad codelengths", "Corrupt PNG");
+      a->code_buffer >>= e & 31;
+      a->num_bits -= e & 31;
+      c = (int) (e >> 16);
       if (c < 16)
          lencodes[n++] = (stbi_uc) c;
       else {
@@ -2163,31 +4515,38 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
       }
    }
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
-   if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!stbi__zbuild_table(a->z_length, STBI__ZLENGTH_BITS, STBI__ZLENGTH_ENOUGH, lencodes, hlit, STBI__ZTABLE_LENGTH)) return 0;
+   if (!stbi__zbuild_table(a->z_distance, STBI__ZDIST_BITS, STBI__ZDIST_ENOUGH, lencodes+hlit, hdist, STBI__ZTABLE_DIST)) return 0;
    return 1;
 }
 
-static int stbi__parse_uncompressed_block(stbi__zbuf *a)
+// reads the header of a stored block, returns its length or -1
+static int stbi__parse_stored_header(stbi__zbuf *a)
 {
    stbi_uc header[4];
    int len,nlen,k;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   STBI_ASSERT(a->num_bits == 0);
-   // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   // the whole bytes of the bit buffer were the last ones read, give them back
+   // to the input but for the zeros read past its end
+   k = (a->num_bits >> 3) - a->zeros;
+   if (k < 0) return stbi__err("read past buffer","Corrupt PNG") - 1;
+   a->zbuffer -= k;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   a->zeros = 0;
+   for (k=0; k < 4; ++k)
+      header[k] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
-   if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
+   if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG") - 1;
+   return len;
+}
+
+static int stbi__parse_uncompressed_block(stbi__zbuf *a)
+{
+   int len = stbi__parse_stored_header(a);
+   if (len < 0) return 0;
    if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
@@ -2256,8 +4615,8 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
-            if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+            if (!stbi__zbuild_table(a->z_length  , STBI__ZLENGTH_BITS, STBI__ZLENGTH_ENOUGH, stbi__zdefault_length  , 288, STBI__ZTABLE_LENGTH)) return 0;
+            if (!stbi__zbuild_table(a->z_distance, STBI__ZDIST_BITS  , STBI__ZDIST_ENOUGH  , stbi__zdefault_distance,  32, STBI__ZTABLE_DIST  )) return 0;
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
@@ -2273,6 +4632,8 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_pausable = 0;
+   a->zeros = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -2392,6 +4753,7 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   stbi_png_stream *stream; // receives the chunks before the image data with STBI__SCAN_stream
 } stbi__png;
 
 
@@ -2400,47 +4762,307 @@ enum {
    STBI__F_sub=1,
    STBI__F_up=2,
    STBI__F_avg=3,
-   STBI__F_paeth=4,
-   // synthetic filters used for first scanline to avoid needing a dummy row of 0s
-   STBI__F_avg_first,
-   STBI__F_paeth_first
+   STBI__F_paeth=4
 };
 
-static stbi_uc first_row_filter[5] =
-{
-   STBI__F_none,
-   STBI__F_sub,
-   STBI__F_none,
-   STBI__F_avg_first,
-   STBI__F_paeth_first
-};
+static int stbi__paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p-a);
+   int pb = abs(p-b);
+   int pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+#ifdef IMG_SSE2
+// the sub, avg and paeth filters depend on the previous pixel, so their SSE2
+// kernels reverse one pixel of bpp <= 8 bytes per step, with the bytes of the
+// pixel in the 16-bit lanes of a register
+stbi_inline static __m128i stbi__load_px(const stbi_uc *p, int bpp)
+{
+   // assembled in registers, as a load from narrower stores to a temporary would stall
+   stbi__uint32 v = 0;
+   stbi__uint16 w;
+   __m128i x;
+   switch (bpp) {
+      case 1: v = p[0]; break;
+      case 3: v = (stbi__uint32) p[2] << 16; // fallthrough
+      case 2: memcpy(&w, p, 2); v |= w; break;
+      default: memcpy(&v, p, 4); break;
+   }
+   x = _mm_cvtsi32_si128((int) v);
+   if (bpp == 6) {
+      memcpy(&w, p+4, 2);
+      x = _mm_insert_epi16(x, w, 2);
+   } else if (bpp == 8) {
+      memcpy(&v, p+4, 4);
+      x = _mm_unpacklo_epi32(x, _mm_cvtsi32_si128((int) v));
+   }
+   return _mm_unpacklo_epi8(x, _mm_setzero_si128());
+}
+
+stbi_inline static void stbi__store_px(stbi_uc *p, __m128i x, int bpp)
+{
+   stbi__uint32 v;
+   stbi__uint16 w;
+   x = _mm_packus_epi16(x, x);
+   if (bpp == 8) {
+      _mm_storel_epi64((__m128i *) p, x);
+      return;
+   }
+   v = (stbi__uint32) _mm_cvtsi128_si32(x);
+   switch (bpp) {
+      case 1: p[0] = (stbi_uc) v; break;
+      case 3: p[2] = (stbi_uc) (v >> 16); // fallthrough
+      case 2: w = (stbi__uint16) v; memcpy(p, &w, 2); break;
+      case 6: w = (stbi__uint16) _mm_extract_epi16(x, 2); memcpy(p+4, &w, 2); // fallthrough
+      default: memcpy(p, &v, 4); break;
+   }
+}
+
+stbi_inline static void stbi__unfilter_sub_sse2(stbi_uc *cur, int len, int bpp)
+{
+   __m128i a = _mm_setzero_si128();
+   int k;
+   for (k=0; k < len; k += bpp) {
+      a = _mm_and_si128(_mm_add_epi16(stbi__load_px(cur+k, bpp), a), _mm_set1_epi16(255));
+      stbi__store_px(cur+k, a, bpp);
+   }
+}
+
+stbi_inline static void stbi__unfilter_avg_sse2(stbi_uc *cur, const stbi_uc *prior, int len, int bpp)
+{
+   __m128i a = _mm_setzero_si128();
+   int k;
+   for (k=0; k < len; k += bpp) {
+      __m128i b = stbi__load_px(prior+k, bpp);
+      a = _mm_add_epi16(stbi__load_px(cur+k, bpp), _mm_srli_epi16(_mm_add_epi16(a, b), 1));
+      a = _mm_and_si128(a, _mm_set1_epi16(255));
+      stbi__store_px(cur+k, a, bpp);
+   }
+}
+
+stbi_inline static __m128i stbi__abs_epi16(__m128i x)
+{
+   return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+stbi_inline static void stbi__unfilter_paeth_sse2(stbi_uc *cur, const stbi_uc *prior, int len, int bpp)
+{
+   __m128i a = _mm_setzero_si128();
+   __m128i c = _mm_setzero_si128();
+   int k;
+   for (k=0; k < len; k += bpp) {
+      __m128i b  = stbi__load_px(prior+k, bpp);
+      // with p = a + b - c: p-a = b-c, p-b = a-c and p-c = (b-c) + (a-c)
+      __m128i pa = _mm_sub_epi16(b, c);
+      __m128i pb = _mm_sub_epi16(a, c);
+      __m128i pc = stbi__abs_epi16(_mm_add_epi16(pa, pb));
+      __m128i m, use_a, use_b, pred;
+      pa = stbi__abs_epi16(pa);
+      pb = stbi__abs_epi16(pb);
+      m = _mm_min_epi16(pa, _mm_min_epi16(pb, pc));
+      use_a = _mm_cmpeq_epi16(m, pa);
+      use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(m, pb));
+      pred = _mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b));
+      pred = _mm_or_si128(pred, _mm_andnot_si128(_mm_or_si128(use_a, use_b), c));
+      a = _mm_and_si128(_mm_add_epi16(stbi__load_px(cur+k, bpp), pred), _mm_set1_epi16(255));
+      stbi__store_px(cur+k, a, bpp);
+      c = b;
+   }
+}
+#endif
+
+#ifdef IMG_TARGET_AVX2
+static int stbi__avx2_available(void)
+{
+   static const int available = __builtin_cpu_supports("avx2");
+   return available;
+}
+
+IMG_TARGET_AVX2 static int stbi__unfilter_up_avx2(stbi_uc *cur, const stbi_uc *prior, int len)
+{
+   int k;
+   for (k=0; k+32 <= len; k += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i *) (cur+k));
+      __m256i b = _mm256_loadu_si256((const __m256i *) (prior+k));
+      _mm256_storeu_si256((__m256i *) (cur+k), _mm256_add_epi8(x, b));
+   }
+   return k;
+}
+#endif
+
+// reverses in place the filter of the len bytes of row cur, with bpp bytes per
+// pixel and prior the previous row once reversed (zeros for the first row)
+static void stbi__unfilter_row(stbi_uc *cur, const stbi_uc *prior, int len, int bpp, int filter)
+{
+   int k = 0;
+   if (filter == STBI__F_up) {
+#ifdef IMG_TARGET_AVX2
+      if (stbi__avx2_available()) k = stbi__unfilter_up_avx2(cur, prior, len);
+#endif
+#ifdef IMG_SSE2
+      for (; k+16 <= len; k += 16) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (cur+k));
+         __m128i b = _mm_loadu_si128((const __m128i *) (prior+k));
+         _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(x, b));
+      }
+#endif
+      for (; k < len; ++k)
+         cur[k] = STBI__BYTECAST(cur[k] + prior[k]);
+      return;
+   }
+#ifdef IMG_SSE2
+   // a constant bpp in each call lets the pixel loads and stores inline
+   #define STBI__UNFILTER(f, ...) \
+      switch (bpp) { \
+         case 1: f(__VA_ARGS__, 1); return; \
+         case 2: f(__VA_ARGS__, 2); return; \
+         case 3: f(__VA_ARGS__, 3); return; \
+         case 4: f(__VA_ARGS__, 4); return; \
+         case 6: f(__VA_ARGS__, 6); return; \
+         case 8: f(__VA_ARGS__, 8); return; \
+      }
+   switch (filter) {
+      case STBI__F_sub:   STBI__UNFILTER(stbi__unfilter_sub_sse2, cur, len); break;
+      case STBI__F_avg:   STBI__UNFILTER(stbi__unfilter_avg_sse2, cur, prior, len); break;
+      case STBI__F_paeth: STBI__UNFILTER(stbi__unfilter_paeth_sse2, cur, prior, len); break;
+   }
+   #undef STBI__UNFILTER
+#endif
+   switch (filter) {
+      case STBI__F_sub:
+         for (k=bpp; k < len; ++k)
+            cur[k] = STBI__BYTECAST(cur[k] + cur[k-bpp]);
+         break;
+      case STBI__F_avg:
+         for (k=0; k < bpp; ++k)
+            cur[k] = STBI__BYTECAST(cur[k] + (prior[k]>>1));
+         for (; k < len; ++k)
+            cur[k] = STBI__BYTECAST(cur[k] + ((prior[k] + cur[k-bpp])>>1));
+         break;
+      case STBI__F_paeth:
+         for (k=0; k < bpp; ++k)
+            cur[k] = STBI__BYTECAST(cur[k] + prior[k]);
+         for (; k < len; ++k)
+            cur[k] = STBI__BYTECAST(cur[k] + stbi__paeth(cur[k-bpp],prior[k],prior[k-bpp]));
+         break;
+   }
+}
+
+static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
-static int stbi__paeth(int a, int b, int c)
+// converts the x pixels of img_n channels of an unfiltered row to out_n channels
+// of 8 bits, or 16 bits in platform order, out_n being img_n or img_n+1 with
+// an opaque alpha
+static void stbi__expand_png_row(stbi_uc *cur, const stbi_uc *in, stbi__uint32 x, int img_n, int out_n, int depth, int color)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   stbi__uint32 i;
+   int k;
+   if (depth == 16) {
+      stbi__uint16 *cur16 = (stbi__uint16 *) cur;
+      for (i=0; i < x; ++i, in += 2*img_n, cur16 += out_n) {
+         for (k=0; k < img_n; ++k)
+            cur16[k] = (stbi__uint16) ((in[2*k] << 8) | in[2*k+1]);
+         if (img_n != out_n) cur16[img_n] = 0xffff;
+      }
+      return;
+   }
+   if (depth == 8) {
+      if (img_n == out_n) {
+         memcpy(cur, in, x*img_n);
+         return;
+      }
+      for (i=0; i < x; ++i, in += img_n, cur += out_n) {
+         for (k=0; k < img_n; ++k)
+            cur[k] = in[k];
+         cur[img_n] = 255;
+      }
+      return;
+   }
+   {
+      stbi_uc *out = cur;
+      // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+      // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+      stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+      // note that the final byte might overshoot and write more data than desired.
+      // we can allocate enough data that this never writes out of memory, but it
+      // could also overwrite the next scanline. can it overwrite non-empty data
+      // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+      // so we need to explicitly clamp the final ones
+
+      if (depth == 4) {
+         for (k=x*img_n; k >= 2; k-=2, ++in) {
+            *cur++ = scale * ((*in >> 4)       );
+            *cur++ = scale * ((*in     ) & 0x0f);
+         }
+         if (k > 0) *cur++ = scale * ((*in >> 4)       );
+      } else if (depth == 2) {
+         for (k=x*img_n; k >= 4; k-=4, ++in) {
+            *cur++ = scale * ((*in >> 6)       );
+            *cur++ = scale * ((*in >> 4) & 0x03);
+            *cur++ = scale * ((*in >> 2) & 0x03);
+            *cur++ = scale * ((*in     ) & 0x03);
+         }
+         if (k > 0) *cur++ = scale * ((*in >> 6)       );
+         if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+         if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+      } else if (depth == 1) {
+         for (k=x*img_n; k >= 8; k-=8, ++in) {
+            *cur++ = scale * ((*in >> 7)       );
+            *cur++ = scale * ((*in >> 6) & 0x01);
+            *cur++ = scale * ((*in >> 5) & 0x01);
+            *cur++ = scale * ((*in >> 4) & 0x01);
+            *cur++ = scale * ((*in >> 3) & 0x01);
+            *cur++ = scale * ((*in >> 2) & 0x01);
+            *cur++ = scale * ((*in >> 1) & 0x01);
+            *cur++ = scale * ((*in     ) & 0x01);
+         }
+         if (k > 0) *cur++ = scale * ((*in >> 7)       );
+         if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+         if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+         if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+         if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+         if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+         if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
+      }
+      if (img_n != out_n) {
+         int q;
+         // insert alpha = 255
+         cur = out;
+         if (img_n == 1) {
+            for (q=x-1; q >= 0; --q) {
+               cur[q*2+1] = 255;
+               cur[q*2+0] = cur[q];
+            }
+         } else {
+            STBI_ASSERT(img_n == 3);
+            for (q=x-1; q >= 0; --q) {
+               cur[q*4+3] = 255;
+               cur[q*4+2] = cur[q*3+2];
+               cur[q*4+1] = cur[q*3+1];
+               cur[q*4+0] = cur[q*3+0];
+            }
+         }
+      }
+   }
 }
 
-static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
-
-// create the png data from post-deflated data
+// create the png data from post-deflated data, unfiltering it in place
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
-   stbi__uint32 i,j,stride = x*out_n*bytes;
+   stbi__uint32 j,stride = x*out_n*bytes;
    stbi__uint32 img_len, img_width_bytes;
-   int k;
+   stbi_uc *prior, *zeros;
    int img_n = s->img_n; // copy it into a local for later
 
    int output_bytes = out_n*bytes;
-   int filter_bytes = img_n*bytes;
-   int width = x;
+   int filter_bytes = depth < 8 ? 1 : img_n*bytes;
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
    a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
@@ -2455,189 +5077,25 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
+   // the first row is unfiltered against a row of zeros
+   zeros = (stbi_uc *) stbi__malloc(img_width_bytes + 1);
+   if (!zeros) return stbi__err("outofmem", "Out of memory");
+   memset(zeros, 0, img_width_bytes + 1);
+   prior = zeros;
+
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
-      stbi_uc *prior;
       int filter = *raw++;
-
-      if (filter > 4)
+      if (filter > 4) {
+         STBI_FREE(zeros);
          return stbi__err("invalid filter","Corrupt PNG");
-
-      if (depth < 8) {
-         STBI_ASSERT(img_width_bytes <= x);
-         cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-         filter_bytes = 1;
-         width = img_width_bytes;
-      }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
-
-      // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
-
-      // handle first byte explicitly
-      for (k=0; k < filter_bytes; ++k) {
-         switch (filter) {
-            case STBI__F_none       : cur[k] = raw[k]; break;
-            case STBI__F_sub        : cur[k] = raw[k]; break;
-            case STBI__F_up         : cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-            case STBI__F_avg        : cur[k] = STBI__BYTECAST(raw[k] + (prior[k]>>1)); break;
-            case STBI__F_paeth      : cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0,prior[k],0)); break;
-            case STBI__F_avg_first  : cur[k] = raw[k]; break;
-            case STBI__F_paeth_first: cur[k] = raw[k]; break;
-         }
-      }
-
-      if (depth == 8) {
-         if (img_n != out_n)
-            cur[img_n] = 255; // first pixel
-         raw += img_n;
-         cur += out_n;
-         prior += out_n;
-      } else if (depth == 16) {
-         if (img_n != out_n) {
-            cur[filter_bytes]   = 255; // first pixel top byte
-            cur[filter_bytes+1] = 255; // first pixel bottom byte
-         }
-         raw += filter_bytes;
-         cur += output_bytes;
-         prior += output_bytes;
-      } else {
-         raw += 1;
-         cur += 1;
-         prior += 1;
-      }
-
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (depth < 8 || img_n == out_n) {
-         int nk = (width - 1)*filter_bytes;
-         #define STBI__CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-         switch (filter) {
-            // "none" filter turns into a memcpy here; make that explicit.
-            case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-         raw += nk;
-      } else {
-         STBI_ASSERT(img_n+1 == out_n);
-         #define STBI__CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[filter_bytes]=255,raw+=filter_bytes,cur+=output_bytes,prior+=output_bytes) \
-                   for (k=0; k < filter_bytes; ++k)
-         switch (filter) {
-            STBI__CASE(STBI__F_none)         { cur[k] = raw[k]; } break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k- output_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k- output_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],prior[k],prior[k- output_bytes])); } break;
-            STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k- output_bytes] >> 1)); } break;
-            STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k- output_bytes],0,0)); } break;
-         }
-         #undef STBI__CASE
-
-         // the loop above sets the high byte of the pixels' alpha, but for
-         // 16 bit png files we also need the low byte set. we'll do that here.
-         if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
-            for (i=0; i < x; ++i,cur+=output_bytes) {
-               cur[filter_bytes+1] = 255;
-            }
-         }
-      }
-   }
-
-   // we make a separate pass to expand bits to pixels; for performance,
-   // this could run two scanlines behind the above code, so it won't
-   // intefere with filtering but will still be in the cache.
-   if (depth < 8) {
-      for (j=0; j < y; ++j) {
-         stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
-      }
-   } else if (depth == 16) {
-      // force the image data from big-endian to platform-native.
-      // this is done in a separate pass due to the decoding relying
-      // on the data being untouched, but could probably be done
-      // per-line during decode if care is taken.
-      stbi_uc *cur = a->out;
-      stbi__uint16 *cur16 = (stbi__uint16*)cur;
-
-      for(i=0; i < x*y*out_n; ++i,cur16++,cur+=2) {
-         *cur16 = (cur[0] << 8) | cur[1];
       }
+      stbi__unfilter_row(raw, prior, img_width_bytes, filter_bytes, filter);
+      stbi__expand_png_row(a->out + stride*j, raw, x, img_n, out_n, depth, color);
+      prior = raw;
+      raw += img_width_bytes;
    }
 
+   STBI_FREE(zeros);
    return 1;
 }
 
@@ -2685,11 +5143,9 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
    return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi_uc *p = z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -2710,11 +5166,9 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
    return 1;
 }
 
-static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int out_n)
+static int stbi__compute_transparency16(stbi__uint16 *p, stbi__uint32 pixel_count, stbi__uint16 tc[3], int out_n)
 {
-   stbi__context *s = z->s;
-   stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-   stbi__uint16 *p = (stbi__uint16*) z->out;
+   stbi__uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 65535 as the alpha value in the output
@@ -2735,17 +5189,9 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
    return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+static void stbi__map_palette(stbi_uc *p, const stbi_uc *orig, stbi__uint32 pixel_count, const stbi_uc *palette, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
-
-   p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
-   if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
-
+   stbi__uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2764,6 +5210,17 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
          p += 4;
       }
    }
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *temp_out;
+
+   temp_out = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
+   if (temp_out == NULL) return stbi__err("outofmem", "Out of memory");
+
+   stbi__map_palette(temp_out, a->out, pixel_count, palette, pal_img_n);
    STBI_FREE(a->out);
    a->out = temp_out;
 
@@ -2772,9 +5229,6 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
-
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
    stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
@@ -2800,7 +5254,7 @@ static void stbi__de_iphone(stbi__png *z)
       }
    } else {
       STBI_ASSERT(s->img_out_n == 4);
-      if (stbi__unpremultiply_on_load) {
+      if (s->options.unpremultiply) {
          // convert bgr to rgb and unpremultiply
          for (i=0; i < pixel_count; ++i) {
             stbi_uc a = p[3];
@@ -2828,6 +5282,44 @@ static void stbi__de_iphone(stbi__png *z)
    }
 }
 
+// the rows of a stream are inflated into a window that holds the 32K of history
+// of the zlib matches, the rows not decoded yet and 32K of room, so that it
+// slides at most once per 32K of output
+#define STBI__STREAM_WINDOW 32768
+#define STBI__STREAM_INPUT  65536 // bytes of buffered IDAT data
+#define STBI__STREAM_MARGIN 1024  // input kept ahead of a block header or a symbol, more than any of them takes
+
+enum
+{
+   STBI__STREAM_header, // next is a block header, or the end of the zlib stream
+   STBI__STREAM_stored,
+   STBI__STREAM_huffman,
+   STBI__STREAM_end
+};
+
+struct stbi_png_stream
+{
+   stbi__context s;
+   stbi__png p;
+   stbi__zbuf z;
+   FILE *f;
+   stbi_uc palette[1024], tc[3];
+   stbi__uint16 tc16[3];
+   int color, pal_img_n, has_trans, out_n, bytes;
+   stbi__uint32 row_bytes;  // filtered bytes of a row, without its filter type
+   stbi__uint32 row;        // next row to decode
+   stbi__uint32 chunk_left; // bytes of the current IDAT chunk not read yet
+   stbi__uint32 crc;        // of the current IDAT chunk
+   stbi__uint32 adler;      // of the inflated data
+   int last_chunk;          // the chunk after the image data was reached
+   int block, final, stored_left, failed;
+   stbi_uc *input;          // 8 bytes a stored block may give back, then STBI__STREAM_INPUT bytes
+   char *window;
+   char *next;              // filter type of the next row in window
+   stbi_uc *rows;           // current and prior unfiltered rows
+   stbi_uc *index;          // palette indices of a row
+};
+
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
@@ -2838,6 +5330,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
    int first=1,k,interlace=0, color=0, is_iphone=0;
    stbi__context *s = z->s;
+   int check_crc;
+   stbi__uint32 crc = 0;
 
    z->expanded = NULL;
    z->idata = NULL;
@@ -2849,6 +5343,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 
    for (;;) {
       stbi__pngchunk c = stbi__get_chunk_header(s);
+      check_crc = 0;
       switch (c.type) {
          case STBI__PNG_TYPE('C','g','B','I'):
             is_iphone = 1;
@@ -2924,6 +5419,25 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
             if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (scan == STBI__SCAN_stream) {
+               stbi_png_stream *st = z->stream;
+               if (interlace) return stbi__err("interlaced","PNG not supported: interlaced PNG cannot be streamed");
+               if (is_iphone) return stbi__err("iphone","PNG not supported: iPhone PNG cannot be streamed");
+               memcpy(st->palette, palette, pal_len*4);
+               if (has_trans) {
+                  memcpy(st->tc, tc, sizeof(tc));
+                  memcpy(st->tc16, tc16, sizeof(tc16));
+               }
+               st->pal_img_n = pal_img_n;
+               st->has_trans = has_trans;
+               st->color = color;
+               st->chunk_left = c.length;
+               if (s->options.verify_checksums) {
+                  static const stbi_uc tag[4] = { 'I','D','A','T' };
+                  st->crc = stbi__crc32(0, tag, 4);
+               }
+               return 1;
+            }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -2936,6 +5450,11 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
+            if (s->options.verify_checksums) {
+               static const stbi_uc tag[4] = { 'I','D','A','T' };
+               crc = stbi__crc32(stbi__crc32(0, tag, 4), z->idata+ioff, c.length);
+               check_crc = 1;
+            }
             ioff += c.length;
             break;
          }
@@ -2950,6 +5469,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
             z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
+            // the adler-32 ends the zlib stream, which iPhone PNGs do not have
+            if (s->options.verify_checksums && !is_iphone) {
+               stbi_uc *a = z->idata + ioff - 4;
+               if (ioff < 6 || stbi__adler32(1, z->expanded, raw_len) !=
+                   ((stbi__uint32) a[0] << 24) + (a[1] << 16) + (a[2] << 8) + a[3])
+                  return stbi__err("bad adler-32","Corrupt PNG");
+            }
             STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
@@ -2958,12 +5484,12 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
-                  if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency16((stbi__uint16 *) z->out, s->img_x * s->img_y, tc16, s->img_out_n)) return 0;
                } else {
-                  if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+                  if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
                }
             }
-            if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
+            if (is_iphone && s->options.convert_iphone_png_to_rgb && s->img_out_n > 2)
                stbi__de_iphone(z);
             if (pal_img_n) {
                // pal_img_n == 3 or 4
@@ -2985,8 +5511,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
-               // not threadsafe
-               static char invalid_chunk[] = "XXXX PNG chunk not known";
+               static thread_local char invalid_chunk[] = "XXXX PNG chunk not known";
                invalid_chunk[0] = STBI__BYTECAST(c.type >> 24);
                invalid_chunk[1] = STBI__BYTECAST(c.type >> 16);
                invalid_chunk[2] = STBI__BYTECAST(c.type >>  8);
@@ -2997,8 +5522,9 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             stbi__skip(s, c.length);
             break;
       }
-      // end of PNG chunk, read and skip CRC
-      stbi__get32be(s);
+      // end of PNG chunk, read and skip CRC, unless it is checked
+      if (stbi__get32be(s) != crc && check_crc)
+         return stbi__err("bad crc","Corrupt PNG");
    }
 }
 
@@ -3078,6 +5604,247 @@ static int stbi__png_is16(stbi__context *s)
    }
    return 1;
 }
+
+// moves the unread input to the front of the buffer, with the 8 bytes before
+// it, and appends the IDAT data that follows
+static int stbi__png_stream_read(stbi_png_stream *st)
+{
+   static const stbi_uc tag[4] = { 'I','D','A','T' };
+   stbi__context *s = &st->s;
+   stbi__zbuf *z = &st->z;
+   stbi_uc *end = st->input + 8 + STBI__STREAM_INPUT;
+   size_t back = z->zbuffer - st->input, left = z->zbuffer_end - z->zbuffer;
+   if (back > 8) back = 8;
+   memmove(st->input, z->zbuffer - back, back + left);
+   z->zbuffer = st->input + back;
+   z->zbuffer_end = z->zbuffer + left;
+   while (!st->last_chunk && z->zbuffer_end < end) {
+      if (st->chunk_left == 0) {
+         stbi__pngchunk c;
+         if (stbi__get32be(s) != st->crc && s->options.verify_checksums)
+            return stbi__err("bad crc","Corrupt PNG");
+         c = stbi__get_chunk_header(s);
+         if (c.type != STBI__PNG_TYPE('I','D','A','T')) {
+            // the chunks after the image data are not read
+            st->last_chunk = 1;
+         } else {
+            st->chunk_left = c.length;
+            if (s->options.verify_checksums)
+               st->crc = stbi__crc32(0, tag, 4);
+         }
+      } else {
+         int n = (int) (end - z->zbuffer_end);
+         if ((stbi__uint32) n > st->chunk_left) n = (int) st->chunk_left;
+         if (!stbi__getn(s, z->zbuffer_end, n)) return stbi__err("outofdata","Corrupt PNG");
+         if (s->options.verify_checksums)
+            st->crc = stbi__crc32(st->crc, z->zbuffer_end, n);
+         z->zbuffer_end += n;
+         st->chunk_left -= n;
+      }
+   }
+   z->zbuffer_pause = st->last_chunk ? z->zbuffer_end : z->zbuffer_end - STBI__STREAM_MARGIN;
+   return 1;
+}
+
+// inflates until the window holds the next row
+static int stbi__png_stream_inflate(stbi_png_stream *st)
+{
+   stbi__context *s = &st->s;
+   stbi__zbuf *z = &st->z;
+   while ((stbi__uint32) (z->zout - st->next) <= st->row_bytes) {
+      char *from;
+      if (z->zout > z->zout_pause) {
+         // slide the window, keeping the last 32K and the rows not decoded yet
+         char *keep = z->zout - STBI__STREAM_WINDOW;
+         if (st->next < keep) keep = st->next;
+         memmove(z->zout_start, keep, z->zout - keep);
+         st->next -= keep - z->zout_start;
+         z->zout  -= keep - z->zout_start;
+      }
+      if (!st->last_chunk && z->zbuffer_end - z->zbuffer < STBI__STREAM_MARGIN)
+         if (!stbi__png_stream_read(st)) return 0;
+      from = z->zout;
+      switch (st->block) {
+         case STBI__STREAM_header:
+            if (st->final) {
+               // the adler-32 of the inflated data ends the zlib stream
+               if (s->options.verify_checksums) {
+                  stbi__uint32 adler = 0;
+                  int k;
+                  if (z->num_bits & 7)
+                     stbi__zreceive(z, z->num_bits & 7);
+                  for (k=0; k < 4; ++k)
+                     adler = (adler << 8) | stbi__zreceive(z, 8);
+                  if (adler != st->adler) return stbi__err("bad adler-32","Corrupt PNG");
+               }
+               st->block = STBI__STREAM_end;
+               break;
+            }
+            st->final = stbi__zreceive(z,1);
+            switch (stbi__zreceive(z,2)) {
+               case 0:
+                  st->stored_left = stbi__parse_stored_header(z);
+                  if (st->stored_left < 0) return 0;
+                  st->block = STBI__STREAM_stored;
+                  break;
+               case 1:
+                  if (!stbi__zbuild_table(z->z_length  , STBI__ZLENGTH_BITS, STBI__ZLENGTH_ENOUGH, stbi__zdefault_length  , 288, STBI__ZTABLE_LENGTH)) return 0;
+                  if (!stbi__zbuild_table(z->z_distance, STBI__ZDIST_BITS  , STBI__ZDIST_ENOUGH  , stbi__zdefault_distance,  32, STBI__ZTABLE_DIST  )) return 0;
+                  st->block = STBI__STREAM_huffman;
+                  break;
+               case 2:
+                  if (!stbi__compute_huffman_codes(z)) return 0;
+                  st->block = STBI__STREAM_huffman;
+                  break;
+               default:
+                  return stbi__err("bad block type","Corrupt PNG");
+            }
+            break;
+         case STBI__STREAM_stored: {
+            int n = st->stored_left;
+            if (n > z->zbuffer_end - z->zbuffer) n = (int) (z->zbuffer_end - z->zbuffer);
+            if (n > z->zout_end - z->zout) n = (int) (z->zout_end - z->zout);
+            if (n == 0 && st->stored_left) return stbi__err("read past buffer","Corrupt PNG");
+            memcpy(z->zout, z->zbuffer, n);
+            z->zbuffer += n;
+            z->zout += n;
+            st->stored_left -= n;
+            if (st->stored_left == 0) st->block = STBI__STREAM_header;
+            break;
+         }
+         case STBI__STREAM_huffman: {
+            int r = stbi__parse_huffman_block(z);
+            if (!r) return 0;
+            if (r == 1) st->block = STBI__STREAM_header;
+            break;
+         }
+         default:
+            return stbi__err("not enough pixels","Corrupt PNG");
+      }
+      if (s->options.verify_checksums)
+         st->adler = stbi__adler32(st->adler, (stbi_uc *) from, z->zout - from);
+   }
+   return 1;
+}
+
+static int stbi__png_stream_row(stbi_png_stream *st, stbi_uc *out)
+{
+   stbi__context *s = &st->s;
+   stbi_uc *cur   = st->rows + ( st->row & 1) * st->row_bytes;
+   stbi_uc *prior = st->rows + (~st->row & 1) * st->row_bytes;
+   int depth = st->p.depth, filter;
+   if (!stbi__png_stream_inflate(st)) return 0;
+   filter = (stbi_uc) *st->next;
+   if (filter > 4) return stbi__err("invalid filter","Corrupt PNG");
+   // later matches may copy the filtered row, unfilter it out of the window
+   memcpy(cur, st->next + 1, st->row_bytes);
+   st->next += st->row_bytes + 1;
+   stbi__unfilter_row(cur, prior, st->row_bytes, depth < 8 ? 1 : s->img_n * st->bytes, filter);
+   if (st->pal_img_n) {
+      stbi__expand_png_row(st->index, cur, s->img_x, 1, 1, depth, st->color);
+      stbi__map_palette(out, st->index, s->img_x, st->palette, st->pal_img_n);
+   } else {
+      stbi__expand_png_row(out, cur, s->img_x, s->img_n, st->out_n, depth, st->color);
+      if (st->has_trans) {
+         if (depth == 16)
+            stbi__compute_transparency16((stbi__uint16 *) out, s->img_x, st->tc16, st->out_n);
+         else
+            stbi__compute_transparency(out, s->img_x, st->tc, st->out_n);
+      }
+   }
+   ++st->row;
+   return 1;
+}
+
+static int stbi__png_stream_start(stbi_png_stream *st)
+{
+   stbi__context *s = &st->s;
+   stbi__zbuf *z = &st->z;
+   stbi__uint32 window;
+   st->p.s = s;
+   st->p.stream = st;
+   if (s->options.flip_vertically) return stbi__err("flip","Rows of a stream cannot be flipped");
+   if (!stbi__parse_png_file(&st->p, STBI__SCAN_stream, 0)) return 0;
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, st->p.depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   st->bytes = st->p.depth == 16 ? 2 : 1;
+   st->out_n = st->pal_img_n ? st->pal_img_n : s->img_n + st->has_trans;
+   st->row_bytes = (s->img_n * s->img_x * st->p.depth + 7) >> 3;
+   window = 2 * STBI__STREAM_WINDOW + 2 * (st->row_bytes + 1);
+   st->input  = (stbi_uc *) stbi__malloc(8 + STBI__STREAM_INPUT);
+   st->window = (char *) stbi__malloc(window);
+   st->rows   = (stbi_uc *) stbi__malloc_mad2(st->row_bytes, 2, 0);
+   st->index  = (stbi_uc *) stbi__malloc(s->img_x);
+   if (!st->input || !st->window || !st->rows || !st->index) return stbi__err("outofmem", "Out of memory");
+   // the first row is unfiltered against a row of zeros
+   memset(st->rows, 0, st->row_bytes * 2);
+
+   z->zbuffer = z->zbuffer_end = st->input;
+   z->zout_start = z->zout = st->next = st->window;
+   z->zout_end   = st->window + window;
+   z->zout_pause = z->zout_end - 266; // room for a symbol, up to 258 bytes and word copies
+   z->z_expandable = 0;
+   z->z_pausable = 1;
+   z->zeros = 0;
+   z->num_bits = 0;
+   z->code_buffer = 0;
+   st->adler = 1;
+   st->block = STBI__STREAM_header;
+   if (!stbi__png_stream_read(st)) return 0;
+   return stbi__parse_zlib_header(z);
+}
+
+STBIDEF stbi_png_stream *stbi_png_stream_open(char const *filename, stbi_load_options const *options)
+{
+   stbi_png_stream *st;
+   FILE *f = stbi__fopen(filename, "rb");
+   if (!f) return (stbi_png_stream *) stbi__errpuc("can't fopen", "Unable to open file");
+   st = (stbi_png_stream *) stbi__malloc(sizeof(stbi_png_stream));
+   if (!st) {
+      fclose(f);
+      return (stbi_png_stream *) stbi__errpuc("outofmem", "Out of memory");
+   }
+   memset(st, 0, sizeof(stbi_png_stream));
+   st->f = f;
+   stbi__start_file(&st->s, f);
+   if (options) st->s.options = *options;
+   if (!stbi__png_stream_start(st)) {
+      stbi_png_stream_close(st);
+      return NULL;
+   }
+   return st;
+}
+
+STBIDEF void stbi_png_stream_info(stbi_png_stream const *st, int *x, int *y, int *comp, int *bits_per_channel)
+{
+   if (x) *x = st->s.img_x;
+   if (y) *y = st->s.img_y;
+   if (comp) *comp = st->out_n;
+   if (bits_per_channel) *bits_per_channel = 8 * st->bytes;
+}
+
+STBIDEF int stbi_png_stream_rows(stbi_png_stream *st, void *rows, int count)
+{
+   size_t stride = (size_t) st->s.img_x * st->out_n * st->bytes;
+   int k;
+   for (k=0; k < count && st->row < st->s.img_y && !st->failed; ++k) {
+      if (!stbi__png_stream_row(st, (stbi_uc *) rows + k * stride)) {
+         st->failed = 1;
+         break;
+      }
+   }
+   return k;
+}
+
+STBIDEF void stbi_png_stream_close(stbi_png_stream *st)
+{
+   if (!st) return;
+   if (st->f) fclose(st->f);
+   STBI_FREE(st->input);
+   STBI_FREE(st->window);
+   STBI_FREE(st->rows);
+   STBI_FREE(st->index);
+   STBI_FREE(st);
+}
 //#endif
 
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
@@ -3092,6 +5859,16 @@ static int stbi__is_16_main(stbi__context *s)
    return 0;
 }
 
+static int stbi__info_bits_main(stbi__context *s, int *x, int *y, int *comp, int *bits_per_channel)
+{
+   stbi__png p;
+   p.s = s;
+   if (!stbi__png_info_raw(&p, x, y, comp))
+      return stbi__err("unknown image type", "Image not of any known type, or corrupt");
+   if (bits_per_channel) *bits_per_channel = p.depth == 16 ? 16 : 8;
+   return 1;
+}
+
 STBIDEF int stbi_info(char const *filename, int *x, int *y, int *comp)
 {
     FILE *f = stbi__fopen(filename, "rb");
@@ -3134,6 +5911,25 @@ STBIDEF int stbi_is_16_bit_from_file(FILE *f)
    return r;
 }
 
+STBIDEF int stbi_info_with_bits(char const *filename, int *x, int *y, int *comp, int *bits_per_channel)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   int result;
+   stbi__context s;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(&s, f);
+   result = stbi__info_bits_main(&s, x, y, comp, bits_per_channel);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_info_from_memory_with_bits(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *bits_per_channel)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__info_bits_main(&s, x, y, comp, bits_per_channel);
+}
+
 STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
 {
    stbi__context s;
@@ -3167,15 +5963,32 @@ STBIDEF int stbi_is_16_bit_from_callbacks(stbi_io_callbacks const *c, void *user
 /******************************************************************************/
 
 
-inline static int stbi_write_png_compression_level = 8;
-inline static int stbi_write_force_png_filter = -1;
-inline static int stbi__flip_vertically_on_write = 0;
+// defaults of the options, per thread
+inline static thread_local int stbi_write_png_compression_level = 8;
+inline static thread_local int stbi_write_force_png_filter = -1;
+inline static thread_local int stbi__flip_vertically_on_write = 0;
+// stbi_write_png_options is declared along with the io functions of img
 
 //STBIWDEF int stbi_write_png(char const *filename, int w, int h, int comp, const void  *data, int stride_in_bytes);
 
 typedef void stbi_write_func(void *context, void *data, int size);
+typedef void stbi_write_row_func(void *context, int y, unsigned char *row);
 
 STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int w, int h, int comp, const void  *data, int stride_in_bytes);
+STBIWDEF int stbi_write_png_rows(char const *filename, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, stbi_write_png_options const *options);
+STBIWDEF int stbi_write_png_rows_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_row_func *rows, void *row_context, stbi_write_png_options const *options);
+
+// push interface of the row writer: the rows are given top-down, by one or more
+// calls of stbi_write_png_stream_rows, and stbi_write_png_stream_close ends the
+// png. opening fails with flip_vertically
+typedef struct stbi_write_png_stream stbi_write_png_stream;
+
+STBIWDEF stbi_write_png_stream *stbi_write_png_stream_open(char const *filename, int w, int h, int comp, stbi_write_png_options const *options);
+STBIWDEF stbi_write_png_stream *stbi_write_png_stream_open_to_func(stbi_write_func *func, void *context, int w, int h, int comp, stbi_write_png_options const *options);
+// rows(row_context, k, row) fills row with the channels of the k-th of the next count rows
+STBIWDEF int stbi_write_png_stream_rows(stbi_write_png_stream *stream, int count, stbi_write_row_func *rows, void *row_context);
+// returns 0 if any write failed or if rows are missing, the file is then removed
+STBIWDEF int stbi_write_png_stream_close(stbi_write_png_stream *stream);
 
 //STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
@@ -3217,241 +6030,700 @@ typedef int stb_image_write_test[sizeof(stbiw_uint32)==4 ? 1 : -1];
 // PNG writer
 //
 
-// stretchy buffer; stbiw__sbpush() == vector<>::push_back() -- stbiw__sbcount() == vector<>::size()
-#define stbiw__sbraw(a) ((int *) (a) - 2)
-#define stbiw__sbm(a)   stbiw__sbraw(a)[0]
-#define stbiw__sbn(a)   stbiw__sbraw(a)[1]
+// stretchy buffer; stbiw__sbpush() == vector<>::push_back() -- stbiw__sbcount() == vector<>::size()
+#define stbiw__sbraw(a) ((int *) (a) - 2)
+#define stbiw__sbm(a)   stbiw__sbraw(a)[0]
+#define stbiw__sbn(a)   stbiw__sbraw(a)[1]
+
+#define stbiw__sbneedgrow(a,n)  ((a)==0 || stbiw__sbn(a)+n >= stbiw__sbm(a))
+#define stbiw__sbmaybegrow(a,n) (stbiw__sbneedgrow(a,(n)) ? stbiw__sbgrow(a,n) : 0)
+#define stbiw__sbgrow(a,n)  stbiw__sbgrowf((void **) &(a), (n), sizeof(*(a)))
+
+#define stbiw__sbpush(a, v)      (stbiw__sbmaybegrow(a,1), (a)[stbiw__sbn(a)++] = (v))
+#define stbiw__sbcount(a)        ((a) ? stbiw__sbn(a) : 0)
+#define stbiw__sbfree(a)         ((a) ? STBIW_FREE(stbiw__sbraw(a)),0 : 0)
+
+static void *stbiw__sbgrowf(void **arr, int increment, int itemsize)
+{
+   int m = *arr ? 2*stbiw__sbm(*arr)+increment : increment+1;
+   void *p = STBIW_REALLOC_SIZED(*arr ? stbiw__sbraw(*arr) : 0, *arr ? (stbiw__sbm(*arr)*itemsize + sizeof(int)*2) : 0, itemsize * m + sizeof(int)*2);
+   STBIW_ASSERT(p);
+   if (p) {
+      if (!*arr) ((int *) p)[1] = 0;
+      *arr = (void *) ((int *) p + 2);
+      stbiw__sbm(*arr) = m;
+   }
+   return *arr;
+}
+
+// streaming compressor: data is appended piece by piece with stbiw__zlib_write()
+// and the compressed bytes are handed to func as soon as stbiw__ZOUT of them are
+// ready, so memory use does not depend on the size of the input. the last 32K of
+// input stay in a sliding window and matches are found through hash chains.
+// matches are buffered and written by blocks of stbiw__ZSYMS symbols, each with
+// its own huffman codes, or the fixed ones when they are smaller
+#define stbiw__ZWSIZE  32768
+#define stbiw__ZWMASK  (stbiw__ZWSIZE-1)
+#define stbiw__ZLOOK   (258+4)  // lookahead needed for a full match plus the lazy check
+#define stbiw__ZBUF    (2*stbiw__ZWSIZE + stbiw__ZLOOK)
+#define stbiw__ZHASHBITS 15
+#define stbiw__ZHASH   (1 << stbiw__ZHASHBITS)
+#define stbiw__ZOUT    16384
+#define stbiw__ZSYMS   16384
+#define stbiw__ZFAR    4096     // matches of 3 bytes further away than this cost more than literals
+#define stbiw__ZSTORED 65535    // input bytes of a stored block
+
+// length of the common prefix of a and b, at most limit <= 258
+static int stbiw__zlib_countm(const unsigned char *a, const unsigned char *b, int limit)
+{
+   int i = 0;
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   for (; i+8 <= limit; i += 8) {
+      unsigned long long x, y;
+      STBIW_MEMMOVE(&x, a+i, 8);
+      STBIW_MEMMOVE(&y, b+i, 8);
+      if (x != y) return i + (__builtin_ctzll(x ^ y) >> 3);
+   }
+#endif
+   for (; i < limit; ++i)
+      if (a[i] != b[i]) break;
+   return i;
+}
+
+static unsigned int stbiw__zhash(const unsigned char *data)
+{
+   stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
+   return (hash * 2654435761u) >> (32 - stbiw__ZHASHBITS);
+}
+
+static int stbiw__zlib_log2(unsigned int x)
+{
+   int n = 0;
+   while (x >>= 1) ++n;
+   return n;
+}
+
+static const unsigned short stbiw__zlib_lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const unsigned char  stbiw__zlib_lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
+static const unsigned short stbiw__zlib_distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const unsigned char  stbiw__zlib_disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+// index of the length code of a match of len bytes, 3 <= len <= 258
+static int stbiw__zlib_lcode(int len)
+{
+   int x = len - 3, b;
+   if (len == 258) return 28;
+   if (x < 8) return x;
+   b = stbiw__zlib_log2(x);
+   return 4*(b-1) + ((x >> (b-2)) & 3);
+}
+
+// distance code of a match at distance d, 1 <= d <= 32768
+static int stbiw__zlib_dcode(int d)
+{
+   int x = d - 1, b;
+   if (x < 4) return x;
+   b = stbiw__zlib_log2(x);
+   return 2*b + ((x >> (b-1)) & 1);
+}
+
+// search parameters of each compression level, as zlib has them
+typedef struct
+{
+   int lazy;       // 0 for greedy matching
+   int max_chain;  // hash chain entries followed for a match
+   int good;       // follow a quarter of the chain once a match this long is found
+   int nice;       // stop searching once a match this long is found
+   int max_lazy;   // do not look for a better match after a match this long (lazy), or
+                   // do not hash the bytes inside longer matches (greedy)
+} stbiw__zlevel;
+
+static const stbiw__zlevel stbiw__zlib_levels[10] = {
+   { 0,    0,  0,   0,   0 }, // 0 stores the input, see stbiw__zlib_stored
+   { 0,    4,  4,   8,   4 }, // 1 greedy, fastest
+   { 0,    8,  4,  16,   5 },
+   { 0,   32,  4,  32,   6 },
+   { 1,   16,  4,  16,   4 }, // 4 lazy
+   { 1,   32,  8,  32,  16 },
+   { 1,  128,  8, 128,  16 },
+   { 1,  256,  8, 128,  32 },
+   { 1, 1024, 32, 258, 128 },
+   { 1, 4096, 32, 258, 258 }, // 9 smallest
+};
+
+typedef struct
+{
+   stbi_write_func *func;
+   void *context;
+   unsigned char *window;   // stbiw__ZBUF bytes of input, positions are relative to it
+   int *head;               // most recent position for each hash, or -1
+   int *prev;               // previous position with the same hash, indexed by pos & stbiw__ZWMASK
+   int pos, end;            // next byte to compress, end of the buffered input
+   int quality;
+   stbiw__zlevel level;
+   int avail;               // lazy matching: the byte before pos is not written yet
+   int prev_len, prev_dist; // lazy matching: match found for the byte before pos
+   unsigned int bitbuf;
+   int bitcount;
+   unsigned int adler;      // adler-32 of the input so far
+   int nsyms;               // symbols of the current block
+   unsigned short sym[stbiw__ZSYMS];  // literal, or length of a match
+   unsigned short dist[stbiw__ZSYMS]; // 0 for a literal, or distance of the match
+   unsigned int lfreq[288], dfreq[32];
+   int out_len;
+   unsigned char out[stbiw__ZOUT];
+} stbiw__zstream;
+
+static void stbiw__zlib_flushout(stbiw__zstream *z)
+{
+   if (z->out_len)
+      z->func(z->context, z->out, z->out_len);
+   z->out_len = 0;
+}
+
+static void stbiw__zlib_add(stbiw__zstream *z, unsigned int code, int codebits)
+{
+   z->bitbuf |= code << z->bitcount;
+   z->bitcount += codebits;
+   while (z->bitcount >= 8) {
+      z->out[z->out_len++] = STBIW_UCHAR(z->bitbuf);
+      if (z->out_len == stbiw__ZOUT)
+         stbiw__zlib_flushout(z);
+      z->bitbuf >>= 8;
+      z->bitcount -= 8;
+   }
+}
+
+// code lengths of at most limit bits for the n symbols of freq: the huffman code
+// of Moffat and Katajainen, then the longest codes are shortened as miniz does
+static void stbiw__zlib_lengths(const unsigned int *freq, int n, int limit, unsigned char *lengths)
+{
+   int sym[288], a[288], num[33];
+   int count = 0, i, j, k, root, leaf, next, avbl, used, dpth;
+   unsigned int total;
+   for (i=0; i < n; ++i) {
+      lengths[i] = 0;
+      if (freq[i]) { // insertion in ascending frequency order
+         for (j=count++; j > 0 && freq[sym[j-1]] > freq[i]; --j)
+            sym[j] = sym[j-1];
+         sym[j] = i;
+      }
+   }
+   if (count == 0) return;
+   if (count == 1) { lengths[sym[0]] = 1; return; }
+   for (i=0; i < count; ++i) a[i] = (int) freq[sym[i]];
+
+   // in place minimum redundancy code
+   a[0] += a[1]; root = 0; leaf = 2;
+   for (next=1; next < count-1; ++next) {
+      if (leaf >= count || a[root] < a[leaf]) { a[next] = a[root]; a[root++] = next; } else a[next] = a[leaf++];
+      if (leaf >= count || (root < next && a[root] < a[leaf])) { a[next] += a[root]; a[root++] = next; } else a[next] += a[leaf++];
+   }
+   a[count-2] = 0;
+   for (next=count-3; next >= 0; --next) a[next] = a[a[next]] + 1;
+   avbl = 1; used = dpth = 0; root = count-2; next = count-1;
+   while (avbl > 0) {
+      while (root >= 0 && a[root] == dpth) { ++used; --root; }
+      while (avbl > used) { a[next--] = dpth; --avbl; }
+      avbl = 2*used; ++dpth; used = 0;
+   }
+
+   // limit the lengths, keeping the code complete
+   for (i=0; i <= 32; ++i) num[i] = 0;
+   for (i=0; i < count; ++i) ++num[a[i] < limit ? a[i] : limit];
+   total = 0;
+   for (i=limit; i > 0; --i) total += (unsigned int) num[i] << (limit - i);
+   while (total != (1u << limit)) {
+      --num[limit];
+      for (i=limit-1; i > 0; --i)
+         if (num[i]) { --num[i]; num[i+1] += 2; break; }
+      --total;
+   }
+   // the rarest symbols get the longest codes
+   for (j=0, i=limit; i > 0; --i)
+      for (k=num[i]; k > 0; --k)
+         lengths[sym[j++]] = (unsigned char) i;
+}
+
+// canonical codes of the lengths, bit reversed as they are written
+static void stbiw__zlib_codes(const unsigned char *lengths, int n, unsigned short *codes)
+{
+   int count[16] = { 0 }, next[16], i, code = 0;
+   for (i=0; i < n; ++i) ++count[lengths[i]];
+   count[0] = 0;
+   for (i=1; i < 16; ++i) {
+      code = (code + count[i-1]) << 1;
+      next[i] = code;
+   }
+   for (i=0; i < n; ++i) {
+      int len = lengths[i], c = len ? next[len]++ : 0, r = 0;
+      while (len--) { r = (r << 1) | (c & 1); c >>= 1; }
+      codes[i] = (unsigned short) r;
+   }
+}
+
+// writes the buffered symbols as one block, with dynamic or fixed codes
+static void stbiw__zlib_block(stbiw__zstream *z, int last)
+{
+   static const unsigned char order[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+   unsigned int lfreq[288], dfreq[32], cfreq[19];
+   unsigned char ll[288], dl[32], cl[19], lens[286 + 30];
+   unsigned short lc[288], dc[32], cc[19];
+   unsigned char rle[286 + 30], rle_extra[286 + 30];
+   int nrle = 0, hlit, hdist, hclen, i, n, used;
+   unsigned int dyn, fixed;
+
+   STBIW_MEMMOVE(lfreq, z->lfreq, sizeof(lfreq));
+   STBIW_MEMMOVE(dfreq, z->dfreq, sizeof(dfreq));
+   lfreq[256] = 1; // end of block
+   // keep at least two codes in each tree, as some decoders require
+   for (i=0, used=0; i < 286; ++i) used += lfreq[i] != 0;
+   if (used < 2) lfreq[lfreq[0] ? 1 : 0] = 1;
+   for (i=0, used=0; i < 30; ++i) used += dfreq[i] != 0;
+   for (i=0; used < 2; ++i)
+      if (!dfreq[i]) { dfreq[i] = 1; ++used; }
+   stbiw__zlib_lengths(lfreq, 286, 15, ll);
+   stbiw__zlib_lengths(dfreq, 30, 15, dl);
+   ll[286] = ll[287] = 0;
+   dl[30] = dl[31] = 0;
+
+   // run lengths of the code lengths
+   for (hlit=286; hlit > 257 && !ll[hlit-1]; --hlit);
+   for (hdist=30; hdist > 1 && !dl[hdist-1]; --hdist);
+   STBIW_MEMMOVE(lens, ll, hlit); // lengths of both trees follow each other
+   STBIW_MEMMOVE(lens + hlit, dl, hdist);
+   for (i=0; i < 19; ++i) cfreq[i] = 0;
+   for (i=0; i < hlit + hdist; i += n) {
+      int len = lens[i];
+      for (n=1; i+n < hlit + hdist && lens[i+n] == len; ++n);
+      if (len == 0 && n >= 11) {
+         if (n > 138) n = 138;
+         rle[nrle] = 18; rle_extra[nrle++] = STBIW_UCHAR(n - 11);
+      } else if (len == 0 && n >= 3) {
+         rle[nrle] = 17; rle_extra[nrle++] = STBIW_UCHAR(n - 3);
+      } else if (len != 0 && n >= 3 && i > 0 && lens[i-1] == len) {
+         if (n > 6) n = 6;
+         rle[nrle] = 16; rle_extra[nrle++] = STBIW_UCHAR(n - 3);
+      } else {
+         n = 1;
+         rle[nrle] = STBIW_UCHAR(len); rle_extra[nrle++] = 0;
+      }
+      ++cfreq[rle[nrle-1]];
+   }
+   stbiw__zlib_lengths(cfreq, 19, 7, cl);
+   for (hclen=19; hclen > 4 && !cl[order[hclen-1]]; --hclen);
+
+   // sizes in bits of both encodings, without the extra bits they share
+   dyn = 3 + 5+5+4 + 3*hclen;
+   for (i=0; i < nrle; ++i)
+      dyn += cl[rle[i]] + (rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : rle[i] == 18 ? 7 : 0);
+   fixed = 3;
+   for (i=0; i < 286; ++i) {
+      int f = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+      dyn += z->lfreq[i] * ll[i];
+      fixed += z->lfreq[i] * f;
+   }
+   dyn += ll[256];
+   fixed += 7;
+   for (i=0; i < 30; ++i) {
+      dyn += z->dfreq[i] * dl[i];
+      fixed += z->dfreq[i] * 5;
+   }
+
+   stbiw__zlib_add(z, last, 1); // BFINAL
+   if (dyn < fixed) {
+      stbiw__zlib_add(z, 2, 2); // BTYPE = 2 -- dynamic huffman
+      stbiw__zlib_add(z, hlit - 257, 5);
+      stbiw__zlib_add(z, hdist - 1, 5);
+      stbiw__zlib_add(z, hclen - 4, 4);
+      for (i=0; i < hclen; ++i)
+         stbiw__zlib_add(z, cl[order[i]], 3);
+      stbiw__zlib_codes(cl, 19, cc);
+      for (i=0; i < nrle; ++i) {
+         stbiw__zlib_add(z, cc[rle[i]], cl[rle[i]]);
+         if (rle[i] >= 16)
+            stbiw__zlib_add(z, rle_extra[i], rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7);
+      }
+   } else {
+      stbiw__zlib_add(z, 1, 2); // BTYPE = 1 -- fixed huffman
+      for (i=0; i < 288; ++i) ll[i] = STBIW_UCHAR(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+      for (i=0; i < 32; ++i) dl[i] = 5;
+   }
+   stbiw__zlib_codes(ll, 288, lc);
+   stbiw__zlib_codes(dl, 32, dc);
+
+   for (i=0; i < z->nsyms; ++i) {
+      int s = z->sym[i], d = z->dist[i];
+      if (d == 0) {
+         stbiw__zlib_add(z, lc[s], ll[s]);
+      } else {
+         int j = stbiw__zlib_lcode(s);
+         stbiw__zlib_add(z, lc[257+j], ll[257+j]);
+         if (stbiw__zlib_lengtheb[j]) stbiw__zlib_add(z, s - stbiw__zlib_lengthc[j], stbiw__zlib_lengtheb[j]);
+         j = stbiw__zlib_dcode(d);
+         stbiw__zlib_add(z, dc[j], dl[j]);
+         if (stbiw__zlib_disteb[j]) stbiw__zlib_add(z, d - stbiw__zlib_distc[j], stbiw__zlib_disteb[j]);
+      }
+   }
+   stbiw__zlib_add(z, lc[256], ll[256]); // end of block
 
-#define stbiw__sbneedgrow(a,n)  ((a)==0 || stbiw__sbn(a)+n >= stbiw__sbm(a))
-#define stbiw__sbmaybegrow(a,n) (stbiw__sbneedgrow(a,(n)) ? stbiw__sbgrow(a,n) : 0)
-#define stbiw__sbgrow(a,n)  stbiw__sbgrowf((void **) &(a), (n), sizeof(*(a)))
+   z->nsyms = 0;
+   memset(z->lfreq, 0, sizeof(z->lfreq));
+   memset(z->dfreq, 0, sizeof(z->dfreq));
+}
 
-#define stbiw__sbpush(a, v)      (stbiw__sbmaybegrow(a,1), (a)[stbiw__sbn(a)++] = (v))
-#define stbiw__sbcount(a)        ((a) ? stbiw__sbn(a) : 0)
-#define stbiw__sbfree(a)         ((a) ? STBIW_FREE(stbiw__sbraw(a)),0 : 0)
+static void stbiw__zlib_literal(stbiw__zstream *z, int c)
+{
+   z->sym[z->nsyms] = (unsigned short) c;
+   z->dist[z->nsyms++] = 0;
+   ++z->lfreq[c];
+   if (z->nsyms == stbiw__ZSYMS) stbiw__zlib_block(z, 0);
+}
 
-static void *stbiw__sbgrowf(void **arr, int increment, int itemsize)
+static void stbiw__zlib_copy(stbiw__zstream *z, int len, int d)
 {
-   int m = *arr ? 2*stbiw__sbm(*arr)+increment : increment+1;
-   void *p = STBIW_REALLOC_SIZED(*arr ? stbiw__sbraw(*arr) : 0, *arr ? (stbiw__sbm(*arr)*itemsize + sizeof(int)*2) : 0, itemsize * m + sizeof(int)*2);
-   STBIW_ASSERT(p);
-   if (p) {
-      if (!*arr) ((int *) p)[1] = 0;
-      *arr = (void *) ((int *) p + 2);
-      stbiw__sbm(*arr) = m;
-   }
-   return *arr;
+   STBIW_ASSERT(d <= 32768 && len >= 3 && len <= 258);
+   z->sym[z->nsyms] = (unsigned short) len;
+   z->dist[z->nsyms++] = (unsigned short) d;
+   ++z->lfreq[257 + stbiw__zlib_lcode(len)];
+   ++z->dfreq[stbiw__zlib_dcode(d)];
+   if (z->nsyms == stbiw__ZSYMS) stbiw__zlib_block(z, 0);
 }
 
-static unsigned char *stbiw__zlib_flushf(unsigned char *data, unsigned int *bitbuffer, int *bitcount)
+static void stbiw__zlib_free(stbiw__zstream *z)
 {
-   while (*bitcount >= 8) {
-      stbiw__sbpush(data, STBIW_UCHAR(*bitbuffer));
-      *bitbuffer >>= 8;
-      *bitcount -= 8;
-   }
-   return data;
+   STBIW_FREE(z->window);
+   STBIW_FREE(z->head);
+   STBIW_FREE(z->prev);
+   z->window = NULL;
+   z->head = z->prev = NULL;
 }
 
-static int stbiw__zlib_bitrev(int code, int codebits)
+// quality is the compression level, from 1 (fastest) to 9 (smallest), or 0 to
+// store the input in uncompressed blocks
+static int stbiw__zlib_init(stbiw__zstream *z, stbi_write_func *func, void *context, int quality)
 {
-   int res=0;
-   while (codebits--) {
-      res = (res << 1) | (code & 1);
-      code >>= 1;
+   int i;
+   z->func = func;
+   z->context = context;
+   z->window = (unsigned char *) STBIW_MALLOC(stbiw__ZBUF);
+   z->head = (int *) STBIW_MALLOC(stbiw__ZHASH * sizeof(int));
+   z->prev = (int *) STBIW_MALLOC(stbiw__ZWSIZE * sizeof(int));
+   if (!z->window || !z->head || !z->prev) {
+      stbiw__zlib_free(z);
+      return 0;
    }
-   return res;
+   for (i=0; i < stbiw__ZHASH; ++i) z->head[i] = -1;
+   for (i=0; i < stbiw__ZWSIZE; ++i) z->prev[i] = -1;
+   z->pos = z->end = 0;
+   z->quality = quality < 0 ? 0 : quality > 9 ? 9 : quality;
+   z->level = stbiw__zlib_levels[z->quality];
+   z->avail = 0;
+   z->prev_len = z->prev_dist = 0;
+   z->bitbuf = 0;
+   z->bitcount = 0;
+   z->adler = 1;
+   z->nsyms = 0;
+   memset(z->lfreq, 0, sizeof(z->lfreq));
+   memset(z->dfreq, 0, sizeof(z->dfreq));
+   z->out_len = 0;
+   return 1;
 }
 
-static unsigned int stbiw__zlib_countm(unsigned char *a, unsigned char *b, int limit)
+// second byte of the zlib header, whose FLEVEL tells how hard the compressor tried
+static int stbiw__zlib_flg(int quality)
 {
-   int i;
-   for (i=0; i < limit && i < 258; ++i)
-      if (a[i] != b[i]) break;
-   return i;
+   return quality <= 1 ? 0x01 : quality <= 5 ? 0x5e : quality == 6 ? 0x9c : 0xda;
 }
 
-static unsigned int stbiw__zhash(unsigned char *data)
+static int stbiw__zlib_begin(stbiw__zstream *z, stbi_write_func *func, void *context, int quality)
 {
-   stbiw_uint32 hash = data[0] + (data[1] << 8) + (data[2] << 16);
-   hash ^= hash << 3;
-   hash += hash >> 5;
-   hash ^= hash << 4;
-   hash += hash >> 17;
-   hash ^= hash << 25;
-   hash += hash >> 6;
-   return hash;
-}
-
-#define stbiw__zlib_flush() (out = stbiw__zlib_flushf(out, &bitbuf, &bitcount))
-#define stbiw__zlib_add(code,codebits) \
-      (bitbuf |= (code) << bitcount, bitcount += (codebits), stbiw__zlib_flush())
-#define stbiw__zlib_huffa(b,c)  stbiw__zlib_add(stbiw__zlib_bitrev(b,c),c)
-// default huffman tables
-#define stbiw__zlib_huff1(n)  stbiw__zlib_huffa(0x30 + (n), 8)
-#define stbiw__zlib_huff2(n)  stbiw__zlib_huffa(0x190 + (n)-144, 9)
-#define stbiw__zlib_huff3(n)  stbiw__zlib_huffa(0 + (n)-256,7)
-#define stbiw__zlib_huff4(n)  stbiw__zlib_huffa(0xc0 + (n)-280,8)
-#define stbiw__zlib_huff(n)  ((n) <= 143 ? stbiw__zlib_huff1(n) : (n) <= 255 ? stbiw__zlib_huff2(n) : (n) <= 279 ? stbiw__zlib_huff3(n) : stbiw__zlib_huff4(n))
-#define stbiw__zlib_huffb(n) ((n) <= 143 ? stbiw__zlib_huff1(n) : stbiw__zlib_huff2(n))
-
-#define stbiw__ZHASH   16384
+   if (!stbiw__zlib_init(z, func, context, quality))
+      return 0;
+   stbiw__zlib_add(z, 0x78, 8); // DEFLATE 32K window
+   stbiw__zlib_add(z, stbiw__zlib_flg(z->quality), 8);
+   return 1;
+}
 
-inline unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+// adds position i to the hash chains and returns the previous head of its chain
+static int stbiw__zlib_insert(stbiw__zstream *z, int i)
+{
+   unsigned int h = stbiw__zhash(z->window + i);
+   int p = z->head[h];
+   z->prev[i & stbiw__ZWMASK] = p;
+   z->head[h] = i;
+   return p;
+}
+
+// length of the longest match for position i that beats best, following the hash
+// chain from p, and its distance in *dist; 0 if there is none
+static int stbiw__zlib_match(stbiw__zstream *z, int i, int p, int best, int *dist)
+{
+   const unsigned char *data = z->window;
+   int limit = z->end - i < 258 ? z->end - i : 258;
+   int chain = best >= z->level.good ? z->level.max_chain >> 2 : z->level.max_chain;
+   int nice = z->level.nice < limit ? z->level.nice : limit;
+   int found = 0;
+   if (best >= limit) return 0;
+   while (p >= 0 && i - p < stbiw__ZWSIZE && chain--) {
+      int next;
+      if (data[p+best] == data[i+best] && data[p] == data[i]) {
+         int d = stbiw__zlib_countm(data+p, data+i, limit);
+         if (d > best) {
+            best = d;
+            *dist = i - p;
+            found = 1;
+            if (d >= nice) break;
+         }
+      }
+      next = z->prev[p & stbiw__ZWMASK];
+      if (next >= p) break; // slot reused by a newer position
+      p = next;
+   }
+   return found ? best : 0;
+}
+
+// hashes the positions [first, last) inside a match
+static void stbiw__zlib_insert_range(stbiw__zstream *z, int first, int last)
 {
-#ifdef STBIW_ZLIB_COMPRESS
-   // user provided a zlib compress implementation, use that
-   return STBIW_ZLIB_COMPRESS(data, data_len, out_len, quality);
-#else // use builtin
-   static unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258, 259 };
-   static unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0 };
-   static unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577, 32768 };
-   static unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
-   unsigned int bitbuf=0;
-   int i,j, bitcount=0;
-   unsigned char *out = NULL;
-   unsigned char ***hash_table = (unsigned char***) STBIW_MALLOC(stbiw__ZHASH * sizeof(char**));
-   if (hash_table == NULL)
-      return NULL;
-   if (quality < 5) quality = 5;
+   if (last > z->end - 2) last = z->end - 2;
+   for (; first < last; ++first)
+      stbiw__zlib_insert(z, first);
+}
 
-   stbiw__sbpush(out, 0x78);   // DEFLATE 32K window
-   stbiw__sbpush(out, 0x5e);   // FLEVEL = 1
-   stbiw__zlib_add(1,1);  // BFINAL = 1
-   stbiw__zlib_add(1,2);  // BTYPE = 1 -- fixed huffman
+static void stbiw__zlib_compress_window(stbiw__zstream *z, int final)
+{
+   unsigned char *data = z->window;
+   int i = z->pos;
+   // until the input is complete, keep enough lookahead to find full length matches
+   int stop = final ? z->end : z->end - stbiw__ZLOOK;
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      hash_table[i] = NULL;
-
-   i=0;
-   while (i < data_len-3) {
-      // hash next 3 bytes of data to be compressed
-      int h = stbiw__zhash(data+i)&(stbiw__ZHASH-1), best=3;
-      unsigned char *bestloc = 0;
-      unsigned char **hlist = hash_table[h];
-      int n = stbiw__sbcount(hlist);
-      for (j=0; j < n; ++j) {
-         if (hlist[j]-data > i-32768) { // if entry lies within window
-            int d = stbiw__zlib_countm(hlist[j], data+i, data_len-i);
-            if (d >= best) best=d,bestloc=hlist[j];
+   if (!z->level.lazy) {
+      while (i < stop) {
+         int len = 0, d = 0;
+         if (i+3 <= z->end) {
+            len = stbiw__zlib_match(z, i, stbiw__zlib_insert(z, i), 2, &d);
+            if (len == 3 && d > stbiw__ZFAR) len = 0;
+         }
+         if (len) {
+            stbiw__zlib_copy(z, len, d);
+            if (len <= z->level.max_lazy)
+               stbiw__zlib_insert_range(z, i+1, i+len);
+            i += len;
+         } else {
+            stbiw__zlib_literal(z, data[i]);
+            ++i;
          }
       }
-      // when hash table entry is too long, delete half the entries
-      if (hash_table[h] && stbiw__sbn(hash_table[h]) == 2*quality) {
-         STBIW_MEMMOVE(hash_table[h], hash_table[h]+quality, sizeof(hash_table[h][0])*quality);
-         stbiw__sbn(hash_table[h]) = quality;
-      }
-      stbiw__sbpush(hash_table[h],data+i);
-
-      if (bestloc) {
-         // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
-         h = stbiw__zhash(data+i+1)&(stbiw__ZHASH-1);
-         hlist = hash_table[h];
-         n = stbiw__sbcount(hlist);
-         for (j=0; j < n; ++j) {
-            if (hlist[j]-data > i-32767) {
-               int e = stbiw__zlib_countm(hlist[j], data+i+1, data_len-i-1);
-               if (e > best) { // if next match is better, bail on current match
-                  bestloc = NULL;
-                  break;
-               }
-            }
+   } else {
+      // the match found at i is only used if the one at i+1 is not longer
+      while (i < stop) {
+         int len = 0, d = 0;
+         if (i+3 <= z->end) {
+            int p = stbiw__zlib_insert(z, i);
+            if (z->prev_len < z->level.max_lazy)
+               len = stbiw__zlib_match(z, i, p, z->prev_len > 2 ? z->prev_len : 2, &d);
+            if (len == 3 && d > stbiw__ZFAR) len = 0;
+         }
+         if (z->prev_len >= 3 && len <= z->prev_len) {
+            int last = i-1 + z->prev_len;
+            stbiw__zlib_copy(z, z->prev_len, z->prev_dist);
+            stbiw__zlib_insert_range(z, i+1, last);
+            i = last;
+            z->avail = 0;
+            z->prev_len = 0;
+         } else {
+            if (z->avail) stbiw__zlib_literal(z, data[i-1]);
+            z->avail = 1;
+            z->prev_len = len;
+            z->prev_dist = d;
+            ++i;
          }
       }
+      if (final && z->avail) { // a match at the last bytes would have been taken
+         stbiw__zlib_literal(z, data[i-1]);
+         z->avail = 0;
+      }
+   }
+   z->pos = i;
+}
 
-      if (bestloc) {
-         int d = (int) (data+i - bestloc); // distance back
-         STBIW_ASSERT(d <= 32767 && best <= 258);
-         for (j=0; best > lengthc[j+1]-1; ++j);
-         stbiw__zlib_huff(j+257);
-         if (lengtheb[j]) stbiw__zlib_add(best - lengthc[j], lengtheb[j]);
-         for (j=0; d > distc[j+1]-1; ++j);
-         stbiw__zlib_add(stbiw__zlib_bitrev(j,5),5);
-         if (disteb[j]) stbiw__zlib_add(d - distc[j], disteb[j]);
-         i += best;
-      } else {
-         stbiw__zlib_huffb(data[i]);
-         ++i;
+// drop the oldest 32K of the window once it is full
+static void stbiw__zlib_slide(stbiw__zstream *z)
+{
+   int i;
+   STBIW_MEMMOVE(z->window, z->window + stbiw__ZWSIZE, z->end - stbiw__ZWSIZE);
+   z->pos -= stbiw__ZWSIZE;
+   z->end -= stbiw__ZWSIZE;
+   for (i=0; i < stbiw__ZHASH; ++i)
+      z->head[i] = z->head[i] >= stbiw__ZWSIZE ? z->head[i] - stbiw__ZWSIZE : -1;
+   for (i=0; i < stbiw__ZWSIZE; ++i)
+      z->prev[i] = z->prev[i] >= stbiw__ZWSIZE ? z->prev[i] - stbiw__ZWSIZE : -1;
+}
+
+// writes the buffered input as a stored block, without looking for matches
+static void stbiw__zlib_stored(stbiw__zstream *z, int last)
+{
+   stbiw__zlib_add(z, last, 1); // BFINAL
+   stbiw__zlib_add(z, 0, 2);    // BTYPE = 0 -- stored
+   if (z->bitcount)
+      stbiw__zlib_add(z, 0, 8 - z->bitcount);
+   stbiw__zlib_add(z, z->end, 16);           // LEN
+   stbiw__zlib_add(z, z->end ^ 0xffff, 16);  // NLEN
+   stbiw__zlib_flushout(z);
+   if (z->end)
+      z->func(z->context, z->window, z->end);
+   z->pos = z->end = 0;
+}
+
+static void stbiw__zlib_write(stbiw__zstream *z, const unsigned char *data, int len)
+{
+   z->adler = stbi__adler32(z->adler, data, len);
+   if (z->quality == 0) {
+      while (len > 0) {
+         int n = stbiw__ZSTORED - z->end;
+         if (n > len) n = len;
+         STBIW_MEMMOVE(z->window + z->end, data, n);
+         z->end += n;
+         data += n;
+         len -= n;
+         if (z->end == stbiw__ZSTORED)
+            stbiw__zlib_stored(z, 0);
       }
+      return;
+   }
+   while (len > 0) {
+      int n = stbiw__ZBUF - z->end;
+      if (n > len) n = len;
+      STBIW_MEMMOVE(z->window + z->end, data, n);
+      z->end += n;
+      data += n;
+      len -= n;
+      stbiw__zlib_compress_window(z, 0);
+      if (z->end == stbiw__ZBUF)
+         stbiw__zlib_slide(z);
+   }
+}
+
+static void stbiw__zlib_end(stbiw__zstream *z)
+{
+   if (z->quality == 0) {
+      stbiw__zlib_stored(z, 1);
+   } else {
+      stbiw__zlib_compress_window(z, 1);
+      stbiw__zlib_block(z, 1);
    }
-   // write out final bytes
-   for (;i < data_len; ++i)
-      stbiw__zlib_huffb(data[i]);
-   stbiw__zlib_huff(256); // end of block
    // pad with 0 bits to byte boundary
-   while (bitcount)
-      stbiw__zlib_add(0,1);
+   if (z->bitcount)
+      stbiw__zlib_add(z, 0, 8 - z->bitcount);
+   stbiw__zlib_add(z, STBIW_UCHAR(z->adler >> 24), 8);
+   stbiw__zlib_add(z, STBIW_UCHAR(z->adler >> 16), 8);
+   stbiw__zlib_add(z, STBIW_UCHAR(z->adler >> 8), 8);
+   stbiw__zlib_add(z, STBIW_UCHAR(z->adler), 8);
+   stbiw__zlib_flushout(z);
+   stbiw__zlib_free(z);
+}
+
+// parallel deflate, as pigz does: the input is cut into chunks deflated
+// independently, each with the preceding 32K of input as dictionary. all but the
+// last chunk end with an empty stored block to realign on a byte boundary, so
+// that the compressed chunks can simply be concatenated
+#define stbiw__ZCHUNK  131072
 
-   for (i=0; i < stbiw__ZHASH; ++i)
-      (void) stbiw__sbfree(hash_table[i]);
-   STBIW_FREE(hash_table);
+typedef struct
+{
+   unsigned char *data;   // input of the chunk, preceded by dict_len bytes of dictionary
+   int len, dict_len;
+   int last, quality;
+   unsigned char *out;    // stretchy buffer of the deflated chunk
+   unsigned int adler;    // adler-32 of the input of the chunk
+   int error;
+} stbiw__zchunk;
 
-   {
-      // compute adler32 on input
-      unsigned int s1=1, s2=0;
-      int blocklen = (int) (data_len % 5552);
-      j=0;
-      while (j < data_len) {
-         for (i=0; i < blocklen; ++i) s1 += data[j+i], s2 += s1;
-         s1 %= 65521, s2 %= 65521;
-         j += blocklen;
-         blocklen = 5552;
-      }
-      stbiw__sbpush(out, STBIW_UCHAR(s2 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s2));
-      stbiw__sbpush(out, STBIW_UCHAR(s1 >> 8));
-      stbiw__sbpush(out, STBIW_UCHAR(s1));
+// start compressing after len bytes of dictionary
+static void stbiw__zlib_prime(stbiw__zstream *z, unsigned char *dict, int len)
+{
+   STBIW_MEMMOVE(z->window, dict, len);
+   z->pos = z->end = len;
+   stbiw__zlib_insert_range(z, 0, len);
+}
+
+static void stbiw__sbwrite(void *context, void *data, int size);
+
+// job deflating chunks[i]
+static void stbiw__zlib_chunk(void *chunks, int i)
+{
+   stbiw__zchunk *c = (stbiw__zchunk *) chunks + i;
+   stbiw__zstream *z = (stbiw__zstream *) STBIW_MALLOC(sizeof(stbiw__zstream));
+   if (!z || !stbiw__zlib_init(z, stbiw__sbwrite, &c->out, c->quality)) {
+      STBIW_FREE(z);
+      c->error = 1;
+      return;
    }
-   *out_len = stbiw__sbn(out);
-   // make returned pointer freeable
-   STBIW_MEMMOVE(stbiw__sbraw(out), out, *out_len);
-   return (unsigned char *) stbiw__sbraw(out);
-#endif // STBIW_ZLIB_COMPRESS
+   stbiw__zlib_prime(z, c->data - c->dict_len, c->dict_len);
+   stbiw__zlib_write(z, c->data, c->len);
+   stbiw__zlib_compress_window(z, 1);
+   stbiw__zlib_block(z, c->last);
+   if (!c->last)
+      stbiw__zlib_add(z, 0, 3); // empty stored block: BFINAL = 0, BTYPE = 0
+   // pad with 0 bits to byte boundary
+   if (z->bitcount)
+      stbiw__zlib_add(z, 0, 8 - z->bitcount);
+   if (!c->last) {
+      stbiw__zlib_add(z, 0x0000, 16); // LEN
+      stbiw__zlib_add(z, 0xffff, 16); // NLEN
+   }
+   stbiw__zlib_flushout(z);
+   c->adler = z->adler;
+   stbiw__zlib_free(z);
+   STBIW_FREE(z);
 }
 
-static unsigned int stbiw__crc32(unsigned char *buffer, int len)
+// adler-32 of the concatenation of two inputs from their adler-32, as zlib does
+static unsigned int stbiw__adler32_combine(unsigned int adler1, unsigned int adler2, int len2)
 {
-   static unsigned int crc_table[256] =
-   {
-      0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-      0x0eDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-      0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-      0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-      0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-      0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-      0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-      0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-      0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-      0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-      0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-      0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-      0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-      0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-      0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-      0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-      0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-      0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-      0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-      0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-      0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-      0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-      0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-      0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-      0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-      0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-      0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-      0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-      0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-      0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-      0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-      0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-   };
+   unsigned int rem = (unsigned int) len2 % 65521;
+   unsigned int sum1 = adler1 & 0xffff;
+   unsigned int sum2 = (rem * sum1) % 65521;
+   sum1 += (adler2 & 0xffff) + 65521 - 1;
+   sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum1 >= 65521) sum1 -= 65521;
+   if (sum2 >= (65521u << 1)) sum2 -= (65521u << 1);
+   if (sum2 >= 65521) sum2 -= 65521;
+   return sum1 | (sum2 << 16);
+}
 
-   unsigned int crc = ~0u;
-   int i;
-   for (i=0; i < len; ++i)
-      crc = (crc >> 8) ^ crc_table[buffer[i] ^ (crc & 0xff)];
-   return ~crc;
+// stbi_write_func appending to a stretchy buffer
+static void stbiw__sbwrite(void *context, void *data, int size)
+{
+   unsigned char **buf = (unsigned char **) context;
+   stbiw__sbmaybegrow(*buf, size);
+   STBIW_MEMMOVE(*buf + stbiw__sbn(*buf), data, size);
+   stbiw__sbn(*buf) += size;
+}
+
+// turns a stretchy buffer into a block freeable with STBIW_FREE
+static unsigned char *stbiw__sbfinish(unsigned char *buf, int *out_len)
+{
+   *out_len = stbiw__sbn(buf);
+   STBIW_MEMMOVE(stbiw__sbraw(buf), buf, *out_len);
+   return (unsigned char *) stbiw__sbraw(buf);
+}
+
+inline unsigned char * stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality)
+{
+   unsigned char *out = NULL;
+   stbiw__zstream *z = (stbiw__zstream *) STBIW_MALLOC(sizeof(stbiw__zstream));
+   if (!z) return NULL;
+   if (!stbiw__zlib_begin(z, stbiw__sbwrite, &out, quality)) {
+      STBIW_FREE(z);
+      return NULL;
+   }
+   stbiw__zlib_write(z, data, data_len);
+   stbiw__zlib_end(z);
+   STBIW_FREE(z);
+   return stbiw__sbfinish(out, out_len);
 }
 
 #define stbiw__wpng4(o,a,b,c,d) ((o)[0]=STBIW_UCHAR(a),(o)[1]=STBIW_UCHAR(b),(o)[2]=STBIW_UCHAR(c),(o)[3]=STBIW_UCHAR(d),(o)+=4)
@@ -3460,7 +6732,7 @@ static unsigned int stbiw__crc32(unsigned char *buffer, int len)
 
 static void stbiw__wpcrc(unsigned char **data, int len)
 {
-   unsigned int crc = stbiw__crc32(*data - len - 4, len+4);
+   unsigned int crc = stbi__crc32(0, *data - len - 4, len+4);
    stbiw__wp32(*data, crc);
 }
 
@@ -3472,156 +6744,583 @@ static unsigned char stbiw__paeth(int a, int b, int c)
    return STBIW_UCHAR(c);
 }
 
-// @OPTIMIZE: provide an option that always forces left-predict or paeth predict
-static void stbiw__encode_png_line(unsigned char *pixels, int stride_bytes, int width, int height, int y, int n, int filter_type, signed char *line_buffer)
+#ifdef IMG_SSE2
+// |v| of 16 signed bytes, as unsigned bytes
+static __m128i stbiw__abs_epi8(__m128i v)
 {
-   static int mapping[] = { 0,1,2,3,4 };
-   static int firstmap[] = { 0,1,0,5,6 };
-   int *mymap = (y != 0) ? mapping : firstmap;
-   int i;
-   int type = mymap[filter_type];
-   unsigned char *z = pixels + stride_bytes * (stbi__flip_vertically_on_write ? height-1-y : y);
-   int signed_stride = stbi__flip_vertically_on_write ? -stride_bytes : stride_bytes;
-   for (i = 0; i < n; ++i) {
-      switch (type) {
-         case 0: line_buffer[i] = z[i]; break;
-         case 1: line_buffer[i] = z[i]; break;
-         case 2: line_buffer[i] = z[i] - z[i-signed_stride]; break;
-         case 3: line_buffer[i] = z[i] - (z[i-signed_stride]>>1); break;
-         case 4: line_buffer[i] = (signed char) (z[i] - stbiw__paeth(0,z[i-signed_stride],0)); break;
-         case 5: line_buffer[i] = z[i]; break;
-         case 6: line_buffer[i] = z[i]; break;
-      }
+   return _mm_min_epu8(v, _mm_sub_epi8(_mm_setzero_si128(), v));
+}
+
+// stbiw__paeth of 8 words
+static __m128i stbiw__paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i pa = _mm_sub_epi16(b, c); // p-a
+   __m128i pb = _mm_sub_epi16(a, c); // p-b
+   __m128i pc = _mm_add_epi16(pa, pb);
+   __m128i not_a, not_b, bc;
+   pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+   pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+   pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+   not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   not_b = _mm_cmpgt_epi16(pb, pc);
+   bc = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+   return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
+}
+#endif
+
+// computes the five filtered versions of the len bytes of row z in a single pass
+// and the sum of their absolute values in est. The n bytes before z and prior
+// must be readable and zero for the first pixel, prior is all zeros for the first
+// row, which gives the same bytes as the special cases of the first row and pixel.
+// out receives the five rows, each preceded by its filter type, len+1 bytes apart
+static void stbiw__filter_row(const unsigned char *z, const unsigned char *prior, int len, int n, unsigned char *out, int est[5])
+{
+   unsigned char *o[5];
+   int i = 0, k;
+   for (k=0; k < 5; ++k) {
+      o[k] = out + k * (len+1);
+      *o[k]++ = STBIW_UCHAR(k);
+      est[k] = 0;
    }
-   for (i=n; i < width*n; ++i) {
-      switch (type) {
-         case 0: line_buffer[i] = z[i]; break;
-         case 1: line_buffer[i] = z[i] - z[i-n]; break;
-         case 2: line_buffer[i] = z[i] - z[i-signed_stride]; break;
-         case 3: line_buffer[i] = z[i] - ((z[i-n] + z[i-signed_stride])>>1); break;
-         case 4: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], z[i-signed_stride], z[i-signed_stride-n]); break;
-         case 5: line_buffer[i] = z[i] - (z[i-n]>>1); break;
-         case 6: line_buffer[i] = z[i] - stbiw__paeth(z[i-n], 0,0); break;
+#ifdef IMG_SSE2
+   {
+      __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+      __m128i s[5];
+      for (k=0; k < 5; ++k) s[k] = zero;
+      for (; i+16 <= len; i += 16) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (z+i));
+         __m128i a = _mm_loadu_si128((const __m128i *) (z+i-n));
+         __m128i b = _mm_loadu_si128((const __m128i *) (prior+i));
+         __m128i c = _mm_loadu_si128((const __m128i *) (prior+i-n));
+         __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+         __m128i paeth = _mm_packus_epi16(
+            stbiw__paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+            stbiw__paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+         __m128i f[5];
+         f[0] = x;
+         f[1] = _mm_sub_epi8(x, a);
+         f[2] = _mm_sub_epi8(x, b);
+         f[3] = _mm_sub_epi8(x, avg);
+         f[4] = _mm_sub_epi8(x, paeth);
+         for (k=0; k < 5; ++k) {
+            _mm_storeu_si128((__m128i *) (o[k]+i), f[k]);
+            s[k] = _mm_add_epi64(s[k], _mm_sad_epu8(stbiw__abs_epi8(f[k]), zero));
+         }
       }
+      for (k=0; k < 5; ++k)
+         est[k] = _mm_cvtsi128_si32(s[k]) + _mm_cvtsi128_si32(_mm_srli_si128(s[k], 8));
+   }
+#endif
+   for (; i < len; ++i) {
+      int a = z[i-n], b = prior[i], c = prior[i-n];
+      o[0][i] = z[i];
+      o[1][i] = STBIW_UCHAR(z[i] - a);
+      o[2][i] = STBIW_UCHAR(z[i] - b);
+      o[3][i] = STBIW_UCHAR(z[i] - ((a + b)>>1));
+      o[4][i] = STBIW_UCHAR(z[i] - stbiw__paeth(a, b, c));
+      for (k=0; k < 5; ++k)
+         est[k] += abs((signed char) o[k][i]);
    }
 }
 
-inline unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
-{
-   int force_filter = stbi_write_force_png_filter;
-   int ctype[5] = { -1, 0, 4, 2, 6 };
-   unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
-   unsigned char *out,*o, *filt, *zlib;
-   signed char *line_buffer;
-   int j,zlen;
+// streaming png encoder: rows are filtered and compressed by strips and the
+// compressed data leaves in IDAT chunks of at most stbiw__PNG_IDAT bytes, so only
+// the rows of one strip are ever held in memory. Strips are a single row unless
+// a parallel function is given, then the rows of a strip are filtered in parallel
+#define stbiw__PNG_IDAT   65536
+#define stbiw__PNG_FILTER 32768 // bytes of rows filtered per job
 
-   if (stride_bytes == 0)
-      stride_bytes = x * n;
+typedef struct
+{
+   stbi_write_func *func;
+   void *context;
+   int x, n;                  // row size and bytes per pixel
+   int force_filter;
+   int stride, len;           // bytes from row to row, bytes of the filtered row
+   int strip, count, per_job; // rows per strip, rows in the strip, rows filtered per job
+   unsigned char *rows;       // previous row then the strip, each after n bytes of zeros
+   unsigned char *lines;      // the five filtered rows of each row of the strip
+   int *best;                 // filter picked for each row of the strip
+   unsigned char *idat;       // chunk being filled: length, tag, data and crc
+   int idat_len;
+   int error;
+   stbiw__zstream z;
+
+   // parallel filter, and parallel deflate used instead of z when chunked
+   stbi_write_parallel_func *parallel;
+   void *parallel_context;
+   int chunked;
+   int quality;
+   int chunks;                // chunks deflated per call of parallel
+   unsigned char *batch;      // 32K of dictionary followed by the input of the chunks
+   int batch_len, dict_len;   // input bytes after the dictionary, dictionary bytes
+   stbiw__zchunk *jobs;
+   unsigned int adler;        // adler-32 of the input of the chunks done
+} stbiw__png_stream;
+
+// row k of the strip, row 0 being the last row of the previous strip
+#define stbiw__png_strip_row(p,k) ((p)->rows + (size_t) (k) * (p)->stride + (p)->n)
+
+static void stbiw__png_flush_idat(stbiw__png_stream *p)
+{
+   unsigned char *o = p->idat;
+   if (p->idat_len == 0) return;
+   stbiw__wp32(o, p->idat_len);
+   stbiw__wptag(o, "IDAT");
+   o += p->idat_len;
+   stbiw__wpcrc(&o, p->idat_len);
+   p->func(p->context, p->idat, p->idat_len + 12);
+   p->idat_len = 0;
+}
+
+static void stbiw__png_idat(void *context, void *data, int size)
+{
+   stbiw__png_stream *p = (stbiw__png_stream *) context;
+   unsigned char *d = (unsigned char *) data;
+   while (size > 0) {
+      int n = stbiw__PNG_IDAT - p->idat_len;
+      if (n > size) n = size;
+      STBIW_MEMMOVE(p->idat + 8 + p->idat_len, d, n);
+      p->idat_len += n;
+      d += n;
+      size -= n;
+      if (p->idat_len == stbiw__PNG_IDAT)
+         stbiw__png_flush_idat(p);
+   }
+}
 
-   if (force_filter >= 5) {
-      force_filter = -1;
+static void stbiw__png_free(stbiw__png_stream *p)
+{
+   STBIW_FREE(p->rows);
+   STBIW_FREE(p->lines);
+   STBIW_FREE(p->best);
+   STBIW_FREE(p->idat);
+   STBIW_FREE(p->batch);
+   STBIW_FREE(p->jobs);
+}
+
+// deflates the batch in parallel and appends the chunks to the idat data
+static void stbiw__png_deflate_batch(stbiw__png_stream *p, int last)
+{
+   unsigned char *data = p->batch + stbiw__ZWSIZE;
+   int count = (p->batch_len + stbiw__ZCHUNK-1) / stbiw__ZCHUNK, i;
+   if (count == 0) count = 1; // an empty last chunk still ends the stream
+   for (i=0; i < count; ++i) {
+      stbiw__zchunk *c = &p->jobs[i];
+      int before = p->dict_len + i * stbiw__ZCHUNK;
+      c->data = data + i * stbiw__ZCHUNK;
+      c->len = i+1 < count ? stbiw__ZCHUNK : p->batch_len - i * stbiw__ZCHUNK;
+      c->dict_len = before < stbiw__ZWSIZE ? before : stbiw__ZWSIZE;
+      c->last = last && i+1 == count;
+      c->quality = p->quality;
+      c->out = NULL;
+      c->adler = 1;
+      c->error = 0;
+   }
+   p->parallel(p->parallel_context, count, stbiw__zlib_chunk, p->jobs);
+   for (i=0; i < count; ++i) {
+      stbiw__zchunk *c = &p->jobs[i];
+      if (c->error || !c->out) {
+         p->error = 1;
+      } else {
+         stbiw__png_idat(p, c->out, stbiw__sbn(c->out));
+         p->adler = stbiw__adler32_combine(p->adler, c->adler, c->len);
+      }
+      stbiw__sbfree(c->out);
+   }
+   // keep the last 32K of input as dictionary of the next chunk
+   if (!last) {
+      int keep = p->dict_len + p->batch_len < stbiw__ZWSIZE ? p->dict_len + p->batch_len : stbiw__ZWSIZE;
+      STBIW_MEMMOVE(p->batch + stbiw__ZWSIZE - keep, data + p->batch_len - keep, keep);
+      p->dict_len = keep;
+      p->batch_len = 0;
    }
+}
 
-   filt = (unsigned char *) STBIW_MALLOC((x*n+1) * y); if (!filt) return 0;
-   line_buffer = (signed char *) STBIW_MALLOC(x * n); if (!line_buffer) { STBIW_FREE(filt); return 0; }
-   for (j=0; j < y; ++j) {
-      int filter_type;
-      if (force_filter > -1) {
-         filter_type = force_filter;
-         stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, force_filter, line_buffer);
-      } else { // Estimate the best filter by running through all of them:
-         int best_filter = 0, best_filter_val = 0x7fffffff, est, i;
-         for (filter_type = 0; filter_type < 5; filter_type++) {
-            stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, filter_type, line_buffer);
-
-            // Estimate the entropy of the line using this filter; the less, the better.
-            est = 0;
-            for (i = 0; i < x*n; ++i) {
-               est += abs((signed char) line_buffer[i]);
-            }
-            if (est < best_filter_val) {
-               best_filter_val = est;
-               best_filter = filter_type;
-            }
-         }
-         if (filter_type != best_filter) {  // If the last iteration already got us the best filter, don't redo it
-            stbiw__encode_png_line(pixels, stride_bytes, x, y, j, n, best_filter, line_buffer);
-            filter_type = best_filter;
-         }
+static void stbiw__png_deflate(stbiw__png_stream *p, unsigned char *data, int len)
+{
+   if (!p->chunked) {
+      stbiw__zlib_write(&p->z, data, len);
+      return;
+   }
+   while (len > 0) {
+      int n = p->chunks * stbiw__ZCHUNK - p->batch_len;
+      if (n == 0) { // batch full and more input: these chunks are not the last ones
+         stbiw__png_deflate_batch(p, 0);
+         continue;
       }
-      // when we get here, filter_type contains the filter type, and line_buffer contains the data
-      filt[j*(x*n+1)] = (unsigned char) filter_type;
-      STBIW_MEMMOVE(filt+j*(x*n+1)+1, line_buffer, x*n);
+      if (n > len) n = len;
+      STBIW_MEMMOVE(p->batch + stbiw__ZWSIZE + p->batch_len, data, n);
+      p->batch_len += n;
+      data += n;
+      len -= n;
    }
-   STBIW_FREE(line_buffer);
-   zlib = stbi_zlib_compress(filt, y*( x*n+1), &zlen, stbi_write_png_compression_level);
-   STBIW_FREE(filt);
-   if (!zlib) return 0;
+}
 
-   // each tag requires 12 bytes of overhead
-   out = (unsigned char *) STBIW_MALLOC(8 + 12+13 + 12+zlen + 12);
-   if (!out) return 0;
-   *out_len = 8 + 12+13 + 12+zlen + 12;
+static int stbiw__png_begin(stbiw__png_stream *p, stbi_write_func *func, void *context, int x, int y, int n, stbi_write_png_options const *options)
+{
+   static const int ctype[5] = { -1, 0, 4, 2, 6 };
+   static const unsigned char sig[8] = { 137,80,78,71,13,10,26,10 };
+   unsigned char header[8 + 12+13], *o = header;
+   int depth = options->bits_per_channel;
+
+   if (depth != 8 && depth != 16) return 0;
+   p->func = func;
+   p->context = context;
+   p->x = x;
+   p->n = n * (depth / 8);
+   p->force_filter = options->force_filter >= 5 ? -1 : options->force_filter;
+   // nothing to gain from filters when the data is stored
+   if (options->compression_level <= 0 && p->force_filter < 0)
+      p->force_filter = 0;
+   p->len = x * p->n;
+   p->stride = p->n + p->len;
+   p->parallel = options->parallel;
+   p->parallel_context = options->parallel_context;
+   p->chunks = options->parallel_chunks > 0 ? options->parallel_chunks : 1;
+   p->per_job = 1;
+   p->strip = 1;
+   if (p->parallel) {
+      p->per_job = stbiw__PNG_FILTER / (p->len + 1);
+      if (p->per_job < 1) p->per_job = 1;
+      p->strip = p->chunks * p->per_job < y ? p->chunks * p->per_job : y;
+      if (p->strip < 1) p->strip = 1;
+   }
+   p->count = 0;
+   p->rows  = (unsigned char *) STBIW_MALLOC((size_t) (p->strip + 1) * p->stride);
+   p->lines = p->force_filter == 0 ? NULL : (unsigned char *) STBIW_MALLOC((size_t) p->strip * 5 * (p->len + 1));
+   p->best  = (int *) STBIW_MALLOC(p->strip * sizeof(int));
+   p->idat  = (unsigned char *) STBIW_MALLOC(stbiw__PNG_IDAT + 12);
+   p->idat_len = 0;
+   p->error = 0;
+   p->quality = options->compression_level;
+   // small images gain nothing from chunks
+   p->chunked = p->parallel && p->quality > 0 && (double) y * (p->len + 1) > stbiw__ZCHUNK;
+   p->batch = NULL;
+   p->batch_len = p->dict_len = 0;
+   p->jobs = NULL;
+   p->adler = 1;
+   if (p->chunked) {
+      p->batch = (unsigned char *) STBIW_MALLOC(stbiw__ZWSIZE + (size_t) p->chunks * stbiw__ZCHUNK);
+      p->jobs = (stbiw__zchunk *) STBIW_MALLOC(p->chunks * sizeof(stbiw__zchunk));
+   }
+   if (!p->rows || (!p->lines && p->force_filter != 0) || !p->best || !p->idat ||
+       (p->chunked && (!p->batch || !p->jobs)) ||
+       (!p->chunked && !stbiw__zlib_begin(&p->z, stbiw__png_idat, p, p->quality))) {
+      stbiw__png_free(p);
+      return 0;
+   }
 
-   o=out;
    STBIW_MEMMOVE(o,sig,8); o+= 8;
    stbiw__wp32(o, 13); // header length
    stbiw__wptag(o, "IHDR");
    stbiw__wp32(o, x);
    stbiw__wp32(o, y);
-   *o++ = 8;
+   *o++ = STBIW_UCHAR(depth);
    *o++ = STBIW_UCHAR(ctype[n]);
    *o++ = 0;
    *o++ = 0;
    *o++ = 0;
    stbiw__wpcrc(&o,13);
+   // the padding and the previous row of the first row are zeros
+   memset(p->rows, 0, (size_t) (p->strip + 1) * p->stride);
+   func(context, header, sizeof(header));
+   if (p->chunked) {
+      unsigned char zlib_header[2] = { 0x78, 0 }; // DEFLATE 32K window
+      zlib_header[1] = STBIW_UCHAR(stbiw__zlib_flg(p->quality > 9 ? 9 : p->quality));
+      stbiw__png_idat(p, zlib_header, 2);
+   }
+   return 1;
+}
 
-   stbiw__wp32(o, zlen);
-   stbiw__wptag(o, "IDAT");
-   STBIW_MEMMOVE(o, zlib, zlen);
-   o += zlen;
-   STBIW_FREE(zlib);
-   stbiw__wpcrc(&o, zlen);
+// picks the filter of rows [i*per_job, (i+1)*per_job) of the strip
+static void stbiw__png_filter_job(void *jobs, int i)
+{
+   stbiw__png_stream *p = (stbiw__png_stream *) jobs;
+   int k = i * p->per_job, end = k + p->per_job < p->count ? k + p->per_job : p->count;
+   for (; k < end; ++k) {
+      int est[5], f, best = 0;
+      stbiw__filter_row(stbiw__png_strip_row(p, k+1), stbiw__png_strip_row(p, k), p->len, p->n,
+                        p->lines + (size_t) k * 5 * (p->len + 1), est);
+      if (p->force_filter > -1) {
+         best = p->force_filter;
+      } else { // the lower the sum, the better the filter
+         for (f=1; f < 5; ++f)
+            if (est[f] < est[best])
+               best = f;
+      }
+      p->best[k] = best;
+   }
+}
 
+// filters and compresses the rows of the strip
+static void stbiw__png_strip(stbiw__png_stream *p)
+{
+   int jobs = (p->count + p->per_job-1) / p->per_job, k;
+   if (p->force_filter == 0) { // rows go as they are
+      unsigned char none = 0;
+      for (k=0; k < p->count; ++k) {
+         stbiw__png_deflate(p, &none, 1);
+         stbiw__png_deflate(p, stbiw__png_strip_row(p, k+1), p->len);
+      }
+      p->count = 0;
+      return;
+   }
+   if (jobs > 1)
+      p->parallel(p->parallel_context, jobs, stbiw__png_filter_job, p);
+   else
+      stbiw__png_filter_job(p, 0);
+   for (k=0; k < p->count; ++k)
+      stbiw__png_deflate(p, p->lines + ((size_t) k * 5 + p->best[k]) * (p->len + 1), p->len + 1);
+   STBIW_MEMMOVE(p->rows, p->rows + (size_t) p->count * p->stride, p->stride);
+   p->count = 0;
+}
+
+static void stbiw__png_end(stbiw__png_stream *p)
+{
+   unsigned char iend[12], *o = iend;
+   if (p->count) stbiw__png_strip(p);
+   if (p->chunked) {
+      unsigned char adler[4], *a = adler;
+      stbiw__png_deflate_batch(p, 1);
+      stbiw__wp32(a, p->adler);
+      stbiw__png_idat(p, adler, 4);
+   } else {
+      stbiw__zlib_end(&p->z);
+   }
+   stbiw__png_flush_idat(p);
    stbiw__wp32(o,0);
    stbiw__wptag(o, "IEND");
    stbiw__wpcrc(&o,0);
+   p->func(p->context, iend, sizeof(iend));
+   stbiw__png_free(p);
+}
+
+// writes a png whose rows are produced on demand: rows(row_context, j, row) fills
+// row with the x*comp channels of row j, which are requested bottom-up when flipping.
+// options may be NULL to use the defaults of the calling thread
+static stbi_write_png_options const *stbiw__png_options(stbi_write_png_options const *options, stbi_write_png_options *defaults)
+{
+   if (options) return options;
+   defaults->compression_level = stbi_write_png_compression_level;
+   defaults->force_filter = stbi_write_force_png_filter;
+   defaults->flip_vertically = stbi__flip_vertically_on_write;
+   defaults->bits_per_channel = 8;
+   defaults->parallel = NULL;
+   defaults->parallel_context = NULL;
+   defaults->parallel_chunks = 0;
+   return defaults;
+}
+
+STBIWDEF int stbi_write_png_rows_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_row_func *rows, void *row_context, stbi_write_png_options const *options)
+{
+   int j, ok;
+   stbi_write_png_options defaults;
+   stbiw__png_stream *p;
+   options = stbiw__png_options(options, &defaults);
+   p = (stbiw__png_stream *) STBIW_MALLOC(sizeof(stbiw__png_stream));
+   if (!p) return 0;
+   if (!stbiw__png_begin(p, func, context, x, y, comp, options)) {
+      STBIW_FREE(p);
+      return 0;
+   }
+   for (j=0; j < y; ++j) {
+      ++p->count;
+      rows(row_context, options->flip_vertically ? y-1-j : j, stbiw__png_strip_row(p, p->count));
+      if (p->count == p->strip) stbiw__png_strip(p);
+   }
+   stbiw__png_end(p);
+   ok = !p->error;
+   STBIW_FREE(p);
+   return ok;
+}
 
-   STBIW_ASSERT(o == out + *out_len);
+typedef struct
+{
+   FILE *f;
+   int error;
+} stbiw__file_context;
 
-   return out;
+static void stbiw__file_write(void *context, void *data, int size)
+{
+   stbiw__file_context *c = (stbiw__file_context *) context;
+   if (!c->error && fwrite(data, 1, size, c->f) != (size_t) size)
+      c->error = 1;
 }
 
 //#ifndef STBI_WRITE_NO_STDIO
-STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+STBIWDEF int stbi_write_png_rows(char const *filename, int x, int y, int comp, stbi_write_row_func *rows, void *row_context, stbi_write_png_options const *options)
 {
-   FILE *f;
-   int len;
-   unsigned char *png = stbi_write_png_to_mem((unsigned char *) data, stride_bytes, x, y, comp, &len);
-   if (png == NULL) return 0;
+   stbiw__file_context c;
+   int ok;
 #ifdef STBI_MSC_SECURE_CRT
-   if (fopen_s(&f, filename, "wb"))
-      f = NULL;
+   if (fopen_s(&c.f, filename, "wb"))
+      c.f = NULL;
 #else
-   f = fopen(filename, "wb");
+   c.f = fopen(filename, "wb");
 #endif
-   if (!f) { STBIW_FREE(png); return 0; }
-   fwrite(png, 1, len, f);
-   fclose(f);
-   STBIW_FREE(png);
+   if (!c.f) return 0;
+   c.error = 0;
+   ok = stbi_write_png_rows_to_func(stbiw__file_write, &c, x, y, comp, rows, row_context, options);
+   if (fclose(c.f) != 0) c.error = 1;
+   if (!ok || c.error) {
+      remove(filename);
+      return 0;
+   }
    return 1;
 }
 //#endif
 
-STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+struct stbi_write_png_stream
+{
+   stbiw__png_stream p;
+   stbiw__file_context file; // of stbi_write_png_stream_open
+   char *filename;           // removed if the png is not complete
+   int y, row;               // rows of the image, rows given so far
+};
+
+static int stbiw__png_stream_start(stbi_write_png_stream *s, stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_png_options const *options)
 {
-   int len;
-   unsigned char *png = stbi_write_png_to_mem((unsigned char *) data, stride_bytes, x, y, comp, &len);
-   if (png == NULL) return 0;
-   func(context, png, len);
-   STBIW_FREE(png);
+   stbi_write_png_options defaults;
+   options = stbiw__png_options(options, &defaults);
+   // the rows come as they are produced, they cannot be flipped
+   if (options->flip_vertically) return 0;
+   if (!stbiw__png_begin(&s->p, func, context, x, y, comp, options)) return 0;
+   s->y = y;
+   s->row = 0;
    return 1;
 }
 
+STBIWDEF stbi_write_png_stream *stbi_write_png_stream_open_to_func(stbi_write_func *func, void *context, int x, int y, int comp, stbi_write_png_options const *options)
+{
+   stbi_write_png_stream *s = (stbi_write_png_stream *) STBIW_MALLOC(sizeof(stbi_write_png_stream));
+   if (!s) return NULL;
+   s->file.f = NULL;
+   s->file.error = 0;
+   s->filename = NULL;
+   if (!stbiw__png_stream_start(s, func, context, x, y, comp, options)) {
+      STBIW_FREE(s);
+      return NULL;
+   }
+   return s;
+}
+
+//#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF stbi_write_png_stream *stbi_write_png_stream_open(char const *filename, int x, int y, int comp, stbi_write_png_options const *options)
+{
+   size_t len = strlen(filename) + 1;
+   stbi_write_png_stream *s = (stbi_write_png_stream *) STBIW_MALLOC(sizeof(stbi_write_png_stream));
+   if (!s) return NULL;
+   s->filename = (char *) STBIW_MALLOC(len);
+   if (!s->filename) {
+      STBIW_FREE(s);
+      return NULL;
+   }
+   STBIW_MEMMOVE(s->filename, filename, len);
+#ifdef STBI_MSC_SECURE_CRT
+   if (fopen_s(&s->file.f, filename, "wb"))
+      s->file.f = NULL;
+#else
+   s->file.f = fopen(filename, "wb");
+#endif
+   s->file.error = 0;
+   if (!s->file.f || !stbiw__png_stream_start(s, stbiw__file_write, &s->file, x, y, comp, options)) {
+      if (s->file.f) {
+         fclose(s->file.f);
+         remove(filename);
+      }
+      STBIW_FREE(s->filename);
+      STBIW_FREE(s);
+      return NULL;
+   }
+   return s;
+}
+//#endif
+
+STBIWDEF int stbi_write_png_stream_rows(stbi_write_png_stream *s, int count, stbi_write_row_func *rows, void *row_context)
+{
+   stbiw__png_stream *p = &s->p;
+   int k;
+   if (count < 0 || count > s->y - s->row) return 0;
+   for (k=0; k < count; ++k) {
+      ++p->count;
+      rows(row_context, k, stbiw__png_strip_row(p, p->count));
+      if (p->count == p->strip) stbiw__png_strip(p);
+   }
+   s->row += count;
+   return !p->error && !s->file.error;
+}
+
+STBIWDEF int stbi_write_png_stream_close(stbi_write_png_stream *s)
+{
+   int ok;
+   if (!s) return 0;
+   ok = s->row == s->y;
+   if (ok) {
+      stbiw__png_end(&s->p);
+      ok = !s->p.error;
+   } else {
+      if (!s->p.chunked) stbiw__zlib_free(&s->p.z);
+      stbiw__png_free(&s->p);
+   }
+   if (s->file.f) {
+      if (fclose(s->file.f) != 0) s->file.error = 1;
+      if (!ok || s->file.error) {
+         remove(s->filename);
+         ok = 0;
+      }
+   }
+   STBIW_FREE(s->filename);
+   STBIW_FREE(s);
+   return ok;
+}
+
+typedef struct
+{
+   const unsigned char *pixels;
+   int stride_bytes, len;
+} stbiw__png_pixels;
+
+static void stbiw__png_copy_row(void *context, int y, unsigned char *row)
+{
+   stbiw__png_pixels *c = (stbiw__png_pixels *) context;
+   STBIW_MEMMOVE(row, c->pixels + (size_t) c->stride_bytes * y, c->len);
+}
+
+inline unsigned char *stbi_write_png_to_mem(unsigned char *pixels, int stride_bytes, int x, int y, int n, int *out_len)
+{
+   unsigned char *out = NULL;
+   stbiw__png_pixels c;
+   c.pixels = pixels;
+   c.stride_bytes = stride_bytes ? stride_bytes : x * n;
+   c.len = x * n;
+   if (!stbi_write_png_rows_to_func(stbiw__sbwrite, &out, x, y, n, stbiw__png_copy_row, &c, NULL)) {
+      stbiw__sbfree(out);
+      return 0;
+   }
+   return stbiw__sbfinish(out, out_len);
+}
+
+//#ifndef STBI_WRITE_NO_STDIO
+STBIWDEF int stbi_write_png(char const *filename, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   stbiw__png_pixels c;
+   c.pixels = (const unsigned char *) data;
+   c.stride_bytes = stride_bytes ? stride_bytes : x * comp;
+   c.len = x * comp;
+   return stbi_write_png_rows(filename, x, y, comp, stbiw__png_copy_row, &c, NULL);
+}
+//#endif
+
+STBIWDEF int stbi_write_png_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void *data, int stride_bytes)
+{
+   stbiw__png_pixels c;
+   c.pixels = (const unsigned char *) data;
+   c.stride_bytes = stride_bytes ? stride_bytes : x * comp;
+   c.len = x * comp;
+   return stbi_write_png_rows_to_func(func, context, x, y, comp, stbiw__png_copy_row, &c, NULL);
+}
+
 } // namespace stb
 } // namespace img
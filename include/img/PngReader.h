@@ -0,0 +1,388 @@
+#pragma once
+
+#include <img/Image.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace img {
+
+// png reader ------------------------------------------------------------------
+
+//!
+//! \brief Decode the rows of a PNG file from top to bottom, by strips of a few
+//! rows, as its image data is read
+//!
+//! Besides the strips, only two rows and the window of the compressed data are
+//! held in memory, whatever the size of the image. Interlaced and iPhone PNGs
+//! and LoadOptions::flip are not supported. Failures are reported by open() and
+//! read() returning false, with the reason given by failure_reason().
+//!
+class PngReader
+{
+public:
+    inline PngReader() = default;
+    inline explicit PngReader(const std::string& filename,
+                              const LoadOptions& options = LoadOptions());
+    inline PngReader(const PngReader&) = delete;
+    inline PngReader(PngReader&& other);
+    inline ~PngReader();
+
+    inline PngReader& operator=(const PngReader&) = delete;
+    inline PngReader& operator=(PngReader&& other);
+
+public:
+    inline bool open(const std::string& filename,
+                     const LoadOptions& options = LoadOptions());
+    inline void close();
+    inline bool is_open() const;
+
+public:
+    inline int width() const;
+    inline int height() const;
+    inline int channels() const; //!< \brief channels of the file, with the alpha of a tRNS chunk
+    inline int bits() const;     //!< \brief 8, or 16 for 16-bit files
+    inline int row() const;      //!< \brief index of the next row to read
+    inline bool done() const;    //!< \brief all rows were read
+
+    //!
+    //! \brief Read the next count rows into strip, resized to the number of
+    //! rows read, with the conversions of load()
+    //!
+    //! \return false on failure or if less than count rows were left
+    //!
+    template<typename T, int C>
+    inline bool read(Image<T,C>& strip, int count = 1);
+
+protected:
+    stb::stbi_png_stream*      m_stream   = nullptr;
+    int                        m_width    = 0;
+    int                        m_height   = 0;
+    int                        m_channels = 0;
+    int                        m_bits     = 0;
+    int                        m_row      = 0;
+    std::vector<unsigned char> m_buffer; //!< \brief rows as decoded, before their conversion
+};
+
+// reduced loads ---------------------------------------------------------------
+
+//!
+//! \brief Load the rectangle of height x width pixels whose top-left pixel is
+//! (row,col) of a PNG file, reduced by averaging boxes of factor x factor pixels
+//!
+//! Rows are cropped and averaged as they are decoded, so that besides the
+//! reduced image only one decoded row is held in memory, and decoding stops
+//! after the last row of the rectangle. The image has height/factor rows and
+//! width/factor columns, rounded up, the boxes of the last ones being cut to
+//! the rectangle. Values are averaged as decoded, then converted as by load().
+//! Interlaced and iPhone PNGs are not supported.
+//!
+template<typename T, int C>
+inline bool load_region(const std::string& filename,
+                        Image<T,C>& image,
+                        int row,
+                        int col,
+                        int height,
+                        int width,
+                        int factor = 1,
+                        const LoadOptions& options = LoadOptions());
+
+//! \brief load_region() of the whole image, for thumbnails and previews
+template<typename T, int C>
+inline bool load_thumbnail(const std::string& filename,
+                           Image<T,C>& image,
+                           int factor,
+                           const LoadOptions& options = LoadOptions());
+
+// -----------------------------------------------------------------------------
+
+PngReader::PngReader(const std::string& filename, const LoadOptions& options)
+{
+    open(filename, options);
+}
+
+PngReader::PngReader(PngReader&& other) :
+    m_stream(other.m_stream),
+    m_width(other.m_width),
+    m_height(other.m_height),
+    m_channels(other.m_channels),
+    m_bits(other.m_bits),
+    m_row(other.m_row),
+    m_buffer(std::move(other.m_buffer))
+{
+    other.m_stream = nullptr;
+}
+
+PngReader::~PngReader()
+{
+    close();
+}
+
+PngReader& PngReader::operator=(PngReader&& other)
+{
+    if(this != &other)
+    {
+        close();
+        m_stream   = other.m_stream;
+        m_width    = other.m_width;
+        m_height   = other.m_height;
+        m_channels = other.m_channels;
+        m_bits     = other.m_bits;
+        m_row      = other.m_row;
+        m_buffer   = std::move(other.m_buffer);
+        other.m_stream = nullptr;
+    }
+    return *this;
+}
+
+bool PngReader::open(const std::string& filename, const LoadOptions& options)
+{
+    close();
+    const auto stb_options = internal::stb_options(options);
+    m_stream = stb::stbi_png_stream_open(filename.c_str(), &stb_options);
+    if(m_stream == nullptr)
+        return false;
+    stb::stbi_png_stream_info(m_stream, &m_width, &m_height, &m_channels, &m_bits);
+    m_row = 0;
+    return true;
+}
+
+void PngReader::close()
+{
+    stb::stbi_png_stream_close(m_stream);
+    m_stream   = nullptr;
+    m_width    = 0;
+    m_height   = 0;
+    m_channels = 0;
+    m_bits     = 0;
+    m_row      = 0;
+    m_buffer.clear();
+}
+
+bool PngReader::is_open() const
+{
+    return m_stream != nullptr;
+}
+
+int PngReader::width() const
+{
+    return m_width;
+}
+
+int PngReader::height() const
+{
+    return m_height;
+}
+
+int PngReader::channels() const
+{
+    return m_channels;
+}
+
+int PngReader::bits() const
+{
+    return m_bits;
+}
+
+int PngReader::row() const
+{
+    return m_row;
+}
+
+bool PngReader::done() const
+{
+    return m_row == m_height;
+}
+
+namespace internal {
+
+//!
+//! \brief Decode the rows of stream down to the last one of the rectangle of
+//! load_region(), whose top one is first in the file, and write its boxes of
+//! depth samples of type S in the rows of out
+//!
+template<typename S>
+inline bool reduce_rows(stb::stbi_png_stream* stream,
+                        int file_width,
+                        int depth,
+                        int first,
+                        int col,
+                        int height,
+                        int width,
+                        int factor,
+                        bool flip,
+                        S* out)
+{
+    const int  columns = (width + factor - 1) / factor;
+    const auto stride  = std::size_t(columns) * depth;
+    std::vector<S>             line(std::size_t(file_width) * depth);
+    std::vector<std::uint64_t> sums(factor == 1 ? 0 : stride);
+
+    for(int i = 0; i < first; ++i)
+        if(stb::stbi_png_stream_rows(stream, line.data(), 1) != 1)
+            return false;
+
+    // rows of a box are consecutive in the file, from bottom to top if flipped
+    int box = -1;
+    const auto store = [&]()
+    {
+        const auto rows = std::uint64_t(std::min(factor, height - box * factor));
+        for(int q = 0; q < columns; ++q)
+        {
+            const auto count = rows * std::uint64_t(std::min(factor, width - q * factor));
+            for(int c = 0; c < depth; ++c)
+            {
+                auto& sum = sums[std::size_t(q) * depth + c];
+                out[stride * box + std::size_t(q) * depth + c] = S((sum + count / 2) / count);
+                sum = 0;
+            }
+        }
+    };
+    for(int t = 0; t < height; ++t)
+    {
+        if(stb::stbi_png_stream_rows(stream, line.data(), 1) != 1)
+            return false;
+        const int  i  = flip ? height - 1 - t : t;
+        const S*   in = line.data() + std::size_t(col) * depth;
+        if(factor == 1)
+        {
+            std::memcpy(out + stride * i, in, stride * sizeof(S));
+            continue;
+        }
+        if(i / factor != box)
+        {
+            if(box >= 0) store();
+            box = i / factor;
+        }
+        for(int q = 0, j = 0; q < columns; ++q)
+        {
+            auto sum = sums.data() + std::size_t(q) * depth;
+            for(const int end = std::min(width, j + factor); j < end; ++j, in += depth)
+                for(int c = 0; c < depth; ++c)
+                    sum[c] += in[c];
+        }
+    }
+    if(box >= 0) store();
+    return true;
+}
+
+} // namespace internal
+
+template<typename T, int C>
+bool load_region(const std::string& filename,
+                 Image<T,C>& image,
+                 int row,
+                 int col,
+                 int height,
+                 int width,
+                 int factor,
+                 const LoadOptions& options)
+{
+    image.clear();
+    // parenthesized, stbi__err is also a macro of two arguments
+    if(factor < 1)
+        return (stb::stbi__err)("bad factor");
+
+    // rows are flipped here, the stream only decodes them top to bottom
+    auto stream_options = options;
+    stream_options.flip = false;
+    const auto stb_options = internal::stb_options(stream_options);
+    const auto stream = stb::stbi_png_stream_open(filename.c_str(), &stb_options);
+    if(stream == nullptr)
+        return false;
+    int file_width = 0, file_height = 0, depth = 0, bits = 0;
+    stb::stbi_png_stream_info(stream, &file_width, &file_height, &depth, &bits);
+
+    bool ok = row >= 0 && col >= 0 && height >= 0 && width >= 0 &&
+              row <= file_height - height && col <= file_width - width;
+    if(!ok)
+        (stb::stbi__err)("bad region");
+    else if(height > 0 && width > 0)
+    {
+        const int first = options.flip ? file_height - row - height : row;
+        image.resize((height + factor - 1) / factor, (width + factor - 1) / factor);
+        const auto count = std::size_t(image.size()) * depth;
+
+        // 8-bit pixels that need no conversion are reduced in place
+        if(std::is_same<T, unsigned char>::value && bits == 8 && depth == C)
+        {
+            ok = internal::reduce_rows(stream, file_width, depth, first, col, height, width, factor,
+                                       options.flip, reinterpret_cast<unsigned char*>(image.raw()));
+        }
+        else if(bits == 16)
+        {
+            std::vector<unsigned short> reduced(count);
+            ok = internal::reduce_rows(stream, file_width, depth, first, col, height, width, factor,
+                                       options.flip, reduced.data());
+            if(ok) internal::cast_pixels(reduced.data(), depth, image);
+        }
+        else
+        {
+            std::vector<unsigned char> reduced(count);
+            ok = internal::reduce_rows(stream, file_width, depth, first, col, height, width, factor,
+                                       options.flip, reduced.data());
+            if(ok) internal::cast_pixels(reduced.data(), depth, image);
+        }
+    }
+    stb::stbi_png_stream_close(stream);
+
+    if(!ok)
+        image.clear();
+    return ok;
+}
+
+template<typename T, int C>
+bool load_thumbnail(const std::string& filename, Image<T,C>& image, int factor, const LoadOptions& options)
+{
+    ImageInfo image_info;
+    if(!info(filename, image_info))
+    {
+        image.clear();
+        return false;
+    }
+    return load_region(filename, image, 0, 0, image_info.height, image_info.width, factor, options);
+}
+
+template<typename T, int C>
+bool PngReader::read(Image<T,C>& strip, int count)
+{
+    const int rows = std::max(0, std::min(count, m_height - m_row));
+    if(m_stream == nullptr || rows == 0)
+    {
+        strip.clear();
+        return m_stream != nullptr && count <= 0;
+    }
+
+    // 8-bit rows that need no conversion are decoded in place
+    if constexpr(std::is_same<T, unsigned char>::value)
+    {
+        if(m_bits == 8 && m_channels == C)
+        {
+            strip.resize(rows, m_width);
+            const int read = stb::stbi_png_stream_rows(m_stream, strip.raw(), rows);
+            m_row += read;
+            strip.resize(read, m_width);
+            return read == count;
+        }
+    }
+
+    const auto stride = std::size_t(m_width) * m_channels * (m_bits / 8);
+    m_buffer.resize(stride * rows);
+    const int read = stb::stbi_png_stream_rows(m_stream, m_buffer.data(), rows);
+    m_row += read;
+
+    strip.resize(read, m_width);
+    if(m_bits == 16)
+        internal::cast_pixels(reinterpret_cast<const unsigned short*>(m_buffer.data()), m_channels, strip);
+    else
+        internal::cast_pixels(m_buffer.data(), m_channels, strip);
+
+    return read == count;
+}
+
+} // namespace img
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <img/Image.h>
+
+#include <string>
+
+namespace img {
+
+// png writer ------------------------------------------------------------------
+
+//!
+//! \brief Write a PNG file from top to bottom, by strips of rows given as they
+//! are produced
+//!
+//! The rows are filtered and compressed as soon as they are given, so only a
+//! strip of rows and the compression window are held in memory, and the file
+//! is complete once close() returns true. SaveOptions::flip is not supported.
+//! A file closed before all of its rows were written is removed.
+//!
+class PngWriter
+{
+public:
+    inline PngWriter() = default;
+    inline PngWriter(const std::string& filename,
+                     int height,
+                     int width,
+                     int channels,
+                     const SaveOptions& options = SaveOptions());
+    inline PngWriter(const PngWriter&) = delete;
+    inline PngWriter(PngWriter&& other);
+    inline ~PngWriter();
+
+    inline PngWriter& operator=(const PngWriter&) = delete;
+    inline PngWriter& operator=(PngWriter&& other);
+
+public:
+    //! \brief Start a file of height rows of width pixels of 1 to 4 channels
+    inline bool open(const std::string& filename,
+                     int height,
+                     int width,
+                     int channels,
+                     const SaveOptions& options = SaveOptions());
+
+    //! \brief End the file, false if a write failed or rows are missing
+    inline bool close();
+    inline bool is_open() const;
+
+public:
+    inline int width() const;
+    inline int height() const;
+    inline int channels() const;
+    inline int row() const;   //!< \brief index of the next row to write
+    inline bool done() const; //!< \brief all rows were written
+
+    //!
+    //! \brief Append the rows of strip, whose width and channels must be the
+    //! ones of the file, with the conversions of save()
+    //!
+    template<typename T, int C>
+    inline bool write(const Image<T,C>& strip);
+
+protected:
+    stb::stbi_write_png_stream* m_stream   = nullptr;
+    int                         m_width    = 0;
+    int                         m_height   = 0;
+    int                         m_channels = 0;
+    int                         m_bits     = 8;
+    int                         m_row      = 0;
+};
+
+// -----------------------------------------------------------------------------
+
+PngWriter::PngWriter(const std::string& filename,
+                     int height,
+                     int width,
+                     int channels,
+                     const SaveOptions& options)
+{
+    open(filename, height, width, channels, options);
+}
+
+PngWriter::PngWriter(PngWriter&& other) :
+    m_stream(other.m_stream),
+    m_width(other.m_width),
+    m_height(other.m_height),
+    m_channels(other.m_channels),
+    m_bits(other.m_bits),
+    m_row(other.m_row)
+{
+    other.m_stream = nullptr;
+}
+
+PngWriter::~PngWriter()
+{
+    close();
+}
+
+PngWriter& PngWriter::operator=(PngWriter&& other)
+{
+    if(this != &other)
+    {
+        close();
+        m_stream   = other.m_stream;
+        m_width    = other.m_width;
+        m_height   = other.m_height;
+        m_channels = other.m_channels;
+        m_bits     = other.m_bits;
+        m_row      = other.m_row;
+        other.m_stream = nullptr;
+    }
+    return *this;
+}
+
+bool PngWriter::open(const std::string& filename,
+                     int height,
+                     int width,
+                     int channels,
+                     const SaveOptions& options)
+{
+    close();
+    if(height <= 0 || width <= 0 || channels < 1 || channels > 4)
+        return false;
+    const auto stb_options = internal::stb_options(options);
+    m_stream = stb::stbi_write_png_stream_open(filename.c_str(), width, height, channels, &stb_options);
+    if(m_stream == nullptr)
+        return false;
+    m_width    = width;
+    m_height   = height;
+    m_channels = channels;
+    m_bits     = options.bits;
+    m_row      = 0;
+    return true;
+}
+
+bool PngWriter::close()
+{
+    if(m_stream == nullptr)
+        return false;
+    const bool ok = stb::stbi_write_png_stream_close(m_stream);
+    m_stream   = nullptr;
+    m_width    = 0;
+    m_height   = 0;
+    m_channels = 0;
+    m_row      = 0;
+    return ok;
+}
+
+bool PngWriter::is_open() const
+{
+    return m_stream != nullptr;
+}
+
+int PngWriter::width() const
+{
+    return m_width;
+}
+
+int PngWriter::height() const
+{
+    return m_height;
+}
+
+int PngWriter::channels() const
+{
+    return m_channels;
+}
+
+int PngWriter::row() const
+{
+    return m_row;
+}
+
+bool PngWriter::done() const
+{
+    return m_row == m_height;
+}
+
+template<typename T, int C>
+bool PngWriter::write(const Image<T,C>& strip)
+{
+    if(m_stream == nullptr || C != m_channels || strip.width() != m_width)
+        return false;
+
+    SaveOptions options;
+    options.bits = m_bits;
+    const auto ok = stb::stbi_write_png_stream_rows(m_stream,
+                                                    strip.height(),
+                                                    internal::row_converter<T,C>(options),
+                                                    const_cast<Image<T,C>*>(&strip));
+    if(ok)
+        m_row += strip.height();
+    return ok;
+}
+
+} // namespace img
@@ -0,0 +1,524 @@
+#pragma once
+
+#include <img/Image.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace img {
+
+// raw -------------------------------------------------------------------------
+
+//!
+//! \brief Write image as a raw cache file: a 4096-byte header with the height,
+//! width, channels, type, row stride and CRC-32 of the pixels, followed by the
+//! pixels as they are stored in memory
+//!
+//! Raw files are read back with the byte order of the machine that wrote them.
+//!
+template<typename T, int C>
+inline bool save_raw(const std::string& filename, const Image<T,C>& image);
+
+//!
+//! \brief Read a raw cache file written by save_raw() from an Image<T,C>
+//! \param verify check the CRC-32 of the pixels
+//!
+template<typename T, int C>
+inline bool load_raw(const std::string& filename,
+                     Image<T,C>& image,
+                     bool verify = false);
+
+//!
+//! \brief Write image as a NumPy .npy array of shape (height, width) if C is 1,
+//! (height, width, C) otherwise
+//!
+template<typename T, int C>
+inline bool save_npy(const std::string& filename, const Image<T,C>& image);
+
+//!
+//! \brief Read a NumPy .npy array in C order, of the type T and of the shape
+//! written by save_npy()
+//!
+template<typename T, int C>
+inline bool load_npy(const std::string& filename, Image<T,C>& image);
+
+namespace internal {
+class FileBytes;
+} // namespace internal
+
+//!
+//! \brief Read-only view of the pixels of a file written by save_raw() or
+//! save_npy()
+//!
+//! Regular files are mapped in memory and the pixels are read straight from the
+//! mapping, with no decoding and no copy. Other files, and all files when the
+//! mapping is not available (macro IMG_NO_MMAP), are read in memory once.
+//! Copies of a view share the file, which stays mapped until the last of them
+//! is closed or destroyed.
+//!
+template<typename T, int C>
+class RawView
+{
+public:
+    using ConstColorAccess = typename Image<T,C>::ConstColorAccess;
+
+public:
+    inline RawView() = default;
+    inline explicit RawView(const std::string& filename, bool verify = false);
+
+public:
+    //! \brief Open a raw cache or .npy file, recognized by its header
+    //! \param verify check the CRC-32 of the pixels of a raw cache file
+    inline bool open(const std::string& filename, bool verify = false);
+    inline void close();
+    inline bool is_open() const;
+    inline bool is_mapped() const; //!< \brief pixels are read from a memory mapping
+
+public:
+    inline int height() const;
+    inline int width() const;
+    static constexpr int depth();
+    inline int size() const;
+
+    inline ConstColorAccess operator()(int i, int j) const;
+    inline ConstColorAccess operator()(int k) const;
+
+    inline const T* raw() const;
+
+    //! \brief Copy of the pixels
+    inline Image<T,C> image() const;
+
+protected:
+    std::shared_ptr<const internal::FileBytes> m_file;
+    const T* m_data   = nullptr;
+    int      m_height = 0;
+    int      m_width  = 0;
+};
+
+// -----------------------------------------------------------------------------
+
+namespace internal {
+
+//!
+//! \brief Bytes of a whole file, from a memory mapping when possible, read
+//! through stdio otherwise
+//!
+class FileBytes
+{
+public:
+    inline explicit FileBytes(const std::string& filename);
+
+    FileBytes(const FileBytes&) = delete;
+    FileBytes& operator=(const FileBytes&) = delete;
+
+    inline bool valid() const;
+    inline bool mapped() const;
+    inline const unsigned char* data() const;
+    inline std::size_t size() const;
+
+protected:
+    MappedFile                 m_mapping;
+    std::vector<unsigned char> m_buffer;
+    bool                       m_valid;
+};
+
+FileBytes::FileBytes(const std::string& filename) :
+    m_mapping(filename),
+    m_buffer(),
+    m_valid(m_mapping.valid())
+{
+    if(m_valid) return;
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if(file == nullptr) return;
+    unsigned char chunk[65536];
+    std::size_t count = 0;
+    while((count = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+        m_buffer.insert(m_buffer.end(), chunk, chunk + count);
+    m_valid = !std::ferror(file);
+    std::fclose(file);
+}
+
+bool FileBytes::valid() const
+{
+    return m_valid;
+}
+
+bool FileBytes::mapped() const
+{
+    return m_mapping.valid();
+}
+
+const unsigned char* FileBytes::data() const
+{
+    return m_mapping.valid() ? m_mapping.data() : m_buffer.data();
+}
+
+std::size_t FileBytes::size() const
+{
+    return m_mapping.valid() ? m_mapping.size() : m_buffer.size();
+}
+
+constexpr char        raw_magic[8] = {'I','M','G','R','A','W','\0','\1'};
+constexpr std::size_t raw_offset   = 4096; //!< \brief bytes before the pixels, a page
+constexpr std::uint32_t raw_endian = 0x01020304;
+
+//! \brief Header of raw cache files, followed by zeros up to raw_offset
+struct RawHeader
+{
+    char          magic[8];
+    std::uint32_t endian;   //!< \brief raw_endian in the byte order of the writer
+    std::uint32_t offset;   //!< \brief bytes before the pixels
+    std::uint32_t height;
+    std::uint32_t width;
+    std::uint32_t channels;
+    std::uint32_t type;     //!< \brief raw_type<T>()
+    std::uint64_t stride;   //!< \brief bytes from row to row
+    std::uint32_t crc;      //!< \brief CRC-32 of the pixels
+    std::uint32_t reserved;
+};
+
+//! \brief Size of T, plus 0x100 for signed integers and 0x200 for floating points
+template<typename T>
+constexpr std::uint32_t raw_type()
+{
+    static_assert(std::is_arithmetic<T>::value, "raw files hold arithmetic types only");
+    return std::uint32_t(sizeof(T)) |
+           (std::is_floating_point<T>::value ? 0x200 : std::is_signed<T>::value ? 0x100 : 0);
+}
+
+//! \brief dtype of T in .npy headers, such as '<f4'
+template<typename T>
+inline std::string npy_type()
+{
+    static_assert(std::is_arithmetic<T>::value, "npy files hold arithmetic types only");
+    const std::uint16_t probe = 1;
+    const bool little = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+    const char order  = sizeof(T) == 1 ? '|' : little ? '<' : '>';
+    const char kind   = std::is_floating_point<T>::value ? 'f' : std::is_signed<T>::value ? 'i' : 'u';
+    return std::string{order, kind, char('0' + sizeof(T))};
+}
+
+inline std::uint32_t raw_crc(const void* data, std::size_t size)
+{
+    return stb::stbi__crc32(0, static_cast<const stb::stbi_uc*>(data), size);
+}
+
+//! \brief Pixels of Image<T,C> in a raw cache file, nullptr if it is not one
+template<typename T, int C>
+inline const unsigned char* parse_raw(const unsigned char* data,
+                                      std::size_t size,
+                                      int& height,
+                                      int& width,
+                                      bool verify)
+{
+    RawHeader header;
+    if(size < sizeof(header)) return nullptr;
+    std::memcpy(&header, data, sizeof(header));
+    if(std::memcmp(header.magic, raw_magic, sizeof(raw_magic)) != 0 ||
+       header.endian   != raw_endian ||
+       header.channels != std::uint32_t(C) ||
+       header.type     != raw_type<T>() ||
+       header.offset   <  sizeof(header) ||
+       header.offset   >  size ||
+       header.height   >  std::uint32_t(INT_MAX / C) ||
+       header.width    >  std::uint32_t(INT_MAX / C) ||
+       header.stride   != std::uint64_t(header.width) * C * sizeof(T))
+        return nullptr;
+    // Image sizes are ints
+    if(std::uint64_t(header.height) * header.width * C > std::uint64_t(INT_MAX))
+        return nullptr;
+    const auto bytes = header.stride * header.height;
+    if(bytes > size - header.offset)
+        return nullptr;
+    const auto pixels = data + header.offset;
+    if(verify && raw_crc(pixels, std::size_t(bytes)) != header.crc)
+        return nullptr;
+    height = int(header.height);
+    width  = int(header.width);
+    return pixels;
+}
+
+//! \brief Value of key in the dictionary of a .npy header, empty if missing
+inline std::string npy_field(const std::string& header, const std::string& key)
+{
+    auto pos = header.find("'" + key + "'");
+    if(pos == std::string::npos)
+        pos = header.find("\"" + key + "\"");
+    if(pos == std::string::npos)
+        return std::string();
+    pos = header.find(':', pos + key.size() + 2);
+    if(pos == std::string::npos)
+        return std::string();
+    pos = header.find_first_not_of(' ', pos + 1);
+    if(pos == std::string::npos)
+        return std::string();
+    const char open = header[pos];
+    const auto end  = open == '(' ? header.find(')', pos) :
+                      open == '\'' || open == '"' ? header.find(open, pos + 1) :
+                      header.find_first_of(",}", pos);
+    if(end == std::string::npos)
+        return std::string();
+    if(open == '(' || open == '\'' || open == '"')
+        return header.substr(pos + 1, end - pos - 1);
+    return header.substr(pos, end - pos);
+}
+
+//! \brief Pixels of Image<T,C> in a .npy file, nullptr if it is not one
+template<typename T, int C>
+inline const unsigned char* parse_npy(const unsigned char* data,
+                                      std::size_t size,
+                                      int& height,
+                                      int& width)
+{
+    static const unsigned char magic[6] = {0x93,'N','U','M','P','Y'};
+    if(size < 10 || std::memcmp(data, magic, sizeof(magic)) != 0)
+        return nullptr;
+    // the header length is a little-endian uint16 in version 1, uint32 after
+    std::size_t start  = 10;
+    std::size_t length = std::size_t(data[8]) | std::size_t(data[9]) << 8;
+    if(data[6] >= 2)
+    {
+        if(size < 12) return nullptr;
+        start  = 12;
+        length = length | std::size_t(data[10]) << 16 | std::size_t(data[11]) << 24;
+    }
+    if(length > size - start)
+        return nullptr;
+    const std::string header(reinterpret_cast<const char*>(data) + start, length);
+
+    if(npy_field(header, "descr") != npy_type<T>() ||
+       npy_field(header, "fortran_order") != "False")
+        return nullptr;
+
+    // a shape of (height, width) for gray images, (height, width, C) otherwise
+    const auto shape = npy_field(header, "shape");
+    std::vector<long long> dims;
+    for(const char* p = shape.c_str(); *p; )
+    {
+        char* end = nullptr;
+        const long long value = std::strtoll(p, &end, 10);
+        if(end == p) { ++p; continue; }
+        dims.push_back(value);
+        p = end;
+    }
+    if(!((dims.size() == 3 && dims[2] == C) || (dims.size() == 2 && C == 1)))
+        return nullptr;
+    if(dims[0] < 0 || dims[1] < 0 ||
+       dims[0] > INT_MAX / C || dims[1] > INT_MAX / C ||
+       (dims[1] > 0 && dims[0] > INT_MAX / C / dims[1]))
+        return nullptr;
+    const auto bytes = std::size_t(dims[0]) * std::size_t(dims[1]) * C * sizeof(T);
+    if(bytes > size - start - length)
+        return nullptr;
+    height = int(dims[0]);
+    width  = int(dims[1]);
+    return data + start + length;
+}
+
+//! \brief Write the header and pixels of image, remove the file on failure
+template<typename T, int C>
+inline bool write_pixels(const std::string& filename,
+                         const void* header,
+                         std::size_t header_size,
+                         const Image<T,C>& image)
+{
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if(file == nullptr)
+        return false;
+    const auto bytes = std::size_t(image.size()) * C * sizeof(T);
+    bool ok = std::fwrite(header, 1, header_size, file) == header_size &&
+              (bytes == 0 || std::fwrite(image.raw(), 1, bytes, file) == bytes);
+    ok = std::fclose(file) == 0 && ok;
+    if(!ok)
+        std::remove(filename.c_str());
+    return ok;
+}
+
+template<typename T, int C>
+inline void copy_pixels(const unsigned char* pixels, int height, int width, Image<T,C>& image)
+{
+    image.resize(height, width);
+    if(image.size() > 0)
+        std::memcpy(image.raw(), pixels, std::size_t(image.size()) * C * sizeof(T));
+}
+
+} // namespace internal
+
+template<typename T, int C>
+bool save_raw(const std::string& filename, const Image<T,C>& image)
+{
+    std::vector<unsigned char> header(internal::raw_offset, 0);
+    internal::RawHeader raw;
+    std::memcpy(raw.magic, internal::raw_magic, sizeof(raw.magic));
+    raw.endian   = internal::raw_endian;
+    raw.offset   = std::uint32_t(internal::raw_offset);
+    raw.height   = std::uint32_t(image.height());
+    raw.width    = std::uint32_t(image.width());
+    raw.channels = std::uint32_t(C);
+    raw.type     = internal::raw_type<T>();
+    raw.stride   = std::uint64_t(image.width()) * C * sizeof(T);
+    raw.crc      = internal::raw_crc(image.raw(), std::size_t(image.size()) * C * sizeof(T));
+    raw.reserved = 0;
+    std::memcpy(header.data(), &raw, sizeof(raw));
+    return internal::write_pixels(filename, header.data(), header.size(), image);
+}
+
+template<typename T, int C>
+bool load_raw(const std::string& filename, Image<T,C>& image, bool verify)
+{
+    image.clear();
+    const internal::FileBytes file(filename);
+    int height = 0;
+    int width  = 0;
+    const auto pixels = file.valid() ?
+        internal::parse_raw<T,C>(file.data(), file.size(), height, width, verify) : nullptr;
+    if(pixels == nullptr)
+        return false;
+    internal::copy_pixels(pixels, height, width, image);
+    return true;
+}
+
+template<typename T, int C>
+bool save_npy(const std::string& filename, const Image<T,C>& image)
+{
+    std::string shape = "(" + std::to_string(image.height()) + ", " + std::to_string(image.width());
+    shape += C == 1 ? ")" : ", " + std::to_string(C) + ")";
+    std::string header = "{'descr': '" + internal::npy_type<T>() +
+                         "', 'fortran_order': False, 'shape': " + shape + ", }";
+    // the pixels start on a multiple of 64 bytes, the header ends with a newline
+    const auto total = (10 + header.size() + 1 + 63) / 64 * 64;
+    header.append(total - 10 - header.size() - 1, ' ');
+    header += '\n';
+
+    std::string preamble("\x93NUMPY\x01\x00", 8);
+    preamble += char(header.size() & 0xff);
+    preamble += char(header.size() >> 8);
+    return internal::write_pixels(filename, (preamble + header).data(), total, image);
+}
+
+template<typename T, int C>
+bool load_npy(const std::string& filename, Image<T,C>& image)
+{
+    image.clear();
+    const internal::FileBytes file(filename);
+    int height = 0;
+    int width  = 0;
+    const auto pixels = file.valid() ?
+        internal::parse_npy<T,C>(file.data(), file.size(), height, width) : nullptr;
+    if(pixels == nullptr)
+        return false;
+    internal::copy_pixels(pixels, height, width, image);
+    return true;
+}
+
+// RawView ---------------------------------------------------------------------
+
+template<typename T, int C>
+RawView<T,C>::RawView(const std::string& filename, bool verify)
+{
+    open(filename, verify);
+}
+
+template<typename T, int C>
+bool RawView<T,C>::open(const std::string& filename, bool verify)
+{
+    close();
+    auto file = std::make_shared<const internal::FileBytes>(filename);
+    if(!file->valid())
+        return false;
+    int height = 0;
+    int width  = 0;
+    auto pixels = internal::parse_raw<T,C>(file->data(), file->size(), height, width, verify);
+    if(pixels == nullptr)
+        pixels = internal::parse_npy<T,C>(file->data(), file->size(), height, width);
+    // pixels are read in place, which needs them aligned
+    if(pixels == nullptr || reinterpret_cast<std::uintptr_t>(pixels) % alignof(T) != 0)
+        return false;
+    m_file   = std::move(file);
+    m_data   = reinterpret_cast<const T*>(pixels);
+    m_height = height;
+    m_width  = width;
+    return true;
+}
+
+template<typename T, int C>
+void RawView<T,C>::close()
+{
+    m_file.reset();
+    m_data   = nullptr;
+    m_height = 0;
+    m_width  = 0;
+}
+
+template<typename T, int C>
+bool RawView<T,C>::is_open() const
+{
+    return m_file != nullptr;
+}
+
+template<typename T, int C>
+bool RawView<T,C>::is_mapped() const
+{
+    return m_file != nullptr && m_file->mapped();
+}
+
+template<typename T, int C>
+int RawView<T,C>::height() const
+{
+    return m_height;
+}
+
+template<typename T, int C>
+int RawView<T,C>::width() const
+{
+    return m_width;
+}
+
+template<typename T, int C>
+constexpr int RawView<T,C>::depth()
+{
+    return C;
+}
+
+template<typename T, int C>
+int RawView<T,C>::size() const
+{
+    return m_height * m_width;
+}
+
+template<typename T, int C>
+typename RawView<T,C>::ConstColorAccess RawView<T,C>::operator()(int i, int j) const
+{
+    return this->operator()(i * m_width + j);
+}
+
+template<typename T, int C>
+typename RawView<T,C>::ConstColorAccess RawView<T,C>::operator()(int k) const
+{
+    if constexpr(C == 1)
+        return m_data[k];
+    else
+        return ConstColorAccess(m_data + C * k);
+}
+
+template<typename T, int C>
+const T* RawView<T,C>::raw() const
+{
+    return m_data;
+}
+
+template<typename T, int C>
+Image<T,C> RawView<T,C>::image() const
+{
+    Image<T,C> image;
+    internal::copy_pixels(reinterpret_cast<const unsigned char*>(m_data), m_height, m_width, image);
+    return image;
+}
+
+} // namespace img
@@ -0,0 +1,481 @@
+#pragma once
+
+#include <img/Raw.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// offsets past 2 GB are seeked with fseeko()/_fseeki64()
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#endif
+
+namespace img {
+
+// tiled -----------------------------------------------------------------------
+
+//! \brief Options of save_tiled()
+struct TiledOptions
+{
+    int tile              = 256; //!< \brief width and height of the tiles, in pixels
+    int compression_level = 1;   //!< \brief deflate level of the tiles, 0 stores them as they are
+};
+
+//!
+//! \brief Write image as a tiled file: a header, the index of the tiles and
+//! the tiles, square blocks of pixels deflated independently and in parallel
+//!
+//! Tiles are stored in row-major order, those of the last row and column are
+//! cut to the image. Like raw files, tiled files are read back with the byte
+//! order of the machine that wrote them.
+//!
+template<typename T, int C>
+inline bool save_tiled(const std::string& filename,
+                       const Image<T,C>& image,
+                       const TiledOptions& options = TiledOptions());
+
+//! \brief Read the whole image of a tiled file written from an Image<T,C>
+template<typename T, int C>
+inline bool load_tiled(const std::string& filename, Image<T,C>& image);
+
+//!
+//! \brief Read the rectangle of height x width pixels whose top-left pixel is
+//! (row,col) of a tiled file written from an Image<T,C>
+//!
+template<typename T, int C>
+inline bool load_tiled(const std::string& filename,
+                       Image<T,C>& crop,
+                       int row,
+                       int col,
+                       int height,
+                       int width);
+
+namespace internal {
+
+//! \brief Header of tiled files, followed by the index of the tiles
+struct TiledHeader
+{
+    char          magic[8];
+    std::uint32_t endian;   //!< \brief raw_endian in the byte order of the writer
+    std::uint32_t height;
+    std::uint32_t width;
+    std::uint32_t channels;
+    std::uint32_t type;     //!< \brief raw_type<T>()
+    std::uint32_t tile;     //!< \brief width and height of the tiles
+    std::uint32_t level;    //!< \brief deflate level of the tiles
+    std::uint32_t reserved;
+};
+
+//! \brief Location of a tile in a tiled file
+struct TiledEntry
+{
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+constexpr char tiled_magic[8] = {'I','M','G','T','I','L','E','\1'};
+
+//! \brief type is one of the values of raw_type<T>()
+inline bool valid_raw_type(std::uint32_t type)
+{
+    const auto size = type & 0xFF;
+    switch(type & ~std::uint32_t(0xFF))
+    {
+    case 0x000:
+    case 0x100: return size == 1 || size == 2 || size == 4 || size == 8;
+    case 0x200: return size == sizeof(float) || size == sizeof(double) || size == sizeof(long double);
+    default:    return false;
+    }
+}
+
+//! \brief fseek() to a 64-bit offset, false if it does not fit the platform
+inline bool seek64(std::FILE* file, std::uint64_t offset)
+{
+#if defined(_WIN32)
+    return offset <= std::uint64_t(INT64_MAX) && _fseeki64(file, __int64(offset), SEEK_SET) == 0;
+#elif defined(__unix__) || defined(__APPLE__)
+    return offset <= std::uint64_t(std::numeric_limits<off_t>::max()) && fseeko(file, off_t(offset), SEEK_SET) == 0;
+#else
+    return offset <= std::uint64_t(LONG_MAX) && std::fseek(file, long(offset), SEEK_SET) == 0;
+#endif
+}
+
+//! \brief Size of file, leaving it at its end, false if it cannot be known
+inline bool size64(std::FILE* file, std::uint64_t& size)
+{
+#if defined(_WIN32)
+    const __int64 end = _fseeki64(file, 0, SEEK_END) == 0 ? _ftelli64(file) : -1;
+#elif defined(__unix__) || defined(__APPLE__)
+    const off_t end = fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : -1;
+#else
+    const long end = std::fseek(file, 0, SEEK_END) == 0 ? std::ftell(file) : -1;
+#endif
+    if(end < 0) return false;
+    size = std::uint64_t(end);
+    return true;
+}
+
+} // namespace internal
+
+//!
+//! \brief Random access to the pixels of a tiled file
+//!
+//! The header and the index of the tiles are read once by open(), then each
+//! read() only decodes the tiles touched by its rectangle, in parallel, from a
+//! memory mapping of the file when possible. read() can be called concurrently.
+//!
+class TiledReader
+{
+public:
+    inline TiledReader() = default;
+    inline explicit TiledReader(const std::string& filename);
+
+public:
+    inline bool open(const std::string& filename);
+    inline void close();
+    inline bool is_open() const;
+
+public:
+    inline int height() const;
+    inline int width() const;
+    inline int channels() const;
+    inline int tile() const;
+
+    //!
+    //! \brief Read the rectangle of height x width pixels whose top-left pixel
+    //! is (row,col) into crop
+    //!
+    //! \return false if the file was not written from an Image<T,C>, if the
+    //! rectangle is not inside the image, or if a tile is corrupt
+    //!
+    template<typename T, int C>
+    inline bool read(Image<T,C>& crop, int row, int col, int height, int width) const;
+
+    //! \brief Read the whole image
+    template<typename T, int C>
+    inline bool read(Image<T,C>& image) const;
+
+protected:
+    //! \brief compressed bytes of tile k, from the mapping or read into buffer
+    inline const unsigned char* tile_bytes(int k, std::FILE* file, std::vector<unsigned char>& buffer) const;
+
+protected:
+    std::string                            m_filename;
+    std::shared_ptr<internal::MappedFile>  m_mapping;
+    internal::TiledHeader                  m_header = {};
+    std::vector<internal::TiledEntry>      m_index;
+    int                                    m_tiles_x = 0;
+    int                                    m_tiles_y = 0;
+};
+
+// -----------------------------------------------------------------------------
+
+template<typename T, int C>
+bool save_tiled(const std::string& filename, const Image<T,C>& image, const TiledOptions& options)
+{
+    const int tile = options.tile;
+    if(tile <= 0 || std::size_t(tile) * tile * C * sizeof(T) > std::size_t(INT_MAX))
+        return false;
+    const int tiles_x = (image.width()  + tile - 1) / tile;
+    const int tiles_y = (image.height() + tile - 1) / tile;
+
+    internal::TiledHeader header;
+    std::memcpy(header.magic, internal::tiled_magic, sizeof(header.magic));
+    header.endian   = internal::raw_endian;
+    header.height   = std::uint32_t(image.height());
+    header.width    = std::uint32_t(image.width());
+    header.channels = std::uint32_t(C);
+    header.type     = internal::raw_type<T>();
+    header.tile     = std::uint32_t(tile);
+    header.level    = std::uint32_t(std::max(0, options.compression_level));
+    header.reserved = 0;
+
+    std::FILE* file = std::fopen(filename.c_str(), "wb");
+    if(file == nullptr)
+        return false;
+
+    // the index is written once the sizes of the tiles are known
+    std::vector<internal::TiledEntry> index(std::size_t(tiles_x) * tiles_y);
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    if(!index.empty())
+        ok = ok && std::fwrite(index.data(), sizeof(internal::TiledEntry), index.size(), file) == index.size();
+    std::uint64_t offset = sizeof(header) + index.size() * sizeof(internal::TiledEntry);
+
+    // tiles are deflated in parallel a row of tiles at a time, and written in order
+    struct Deflated
+    {
+        unsigned char* data = nullptr;
+        int            size = 0;
+    };
+    std::vector<Deflated> deflated(tiles_x);
+    for(int ty = 0; ok && ty < tiles_y; ++ty)
+    {
+        std::atomic<bool> failed{false};
+        internal::parallel_for(0, tiles_x, 1, [&](int first, int last)
+        {
+            std::vector<unsigned char> pixels;
+            for(int tx = first; tx < last; ++tx)
+            {
+                const int i0 = ty * tile;
+                const int j0 = tx * tile;
+                const int h  = std::min(tile, image.height() - i0);
+                const int w  = std::min(tile, image.width()  - j0);
+                const auto row = std::size_t(w) * C * sizeof(T);
+                pixels.resize(row * h);
+                for(int i = 0; i < h; ++i)
+                    std::memcpy(pixels.data() + row * i, image.raw() + (std::size_t(i0 + i) * image.width() + j0) * C, row);
+                deflated[tx].data = stb::stbi_zlib_compress(pixels.data(), int(pixels.size()), &deflated[tx].size, int(header.level));
+                if(deflated[tx].data == nullptr)
+                    failed = true;
+            }
+        });
+        for(int tx = 0; tx < tiles_x; ++tx)
+        {
+            auto& d = deflated[tx];
+            ok = ok && !failed && std::fwrite(d.data, 1, d.size, file) == std::size_t(d.size);
+            index[std::size_t(ty) * tiles_x + tx] = {offset, std::uint64_t(d.size)};
+            offset += std::uint64_t(d.size);
+            std::free(d.data);
+            d = Deflated();
+        }
+    }
+
+    if(!index.empty())
+    {
+        ok = ok && internal::seek64(file, sizeof(header));
+        ok = ok && std::fwrite(index.data(), sizeof(internal::TiledEntry), index.size(), file) == index.size();
+    }
+    ok = std::fclose(file) == 0 && ok;
+    if(!ok)
+        std::remove(filename.c_str());
+    return ok;
+}
+
+template<typename T, int C>
+bool load_tiled(const std::string& filename, Image<T,C>& image)
+{
+    image.clear();
+    const TiledReader reader(filename);
+    return reader.read(image);
+}
+
+template<typename T, int C>
+bool load_tiled(const std::string& filename, Image<T,C>& crop, int row, int col, int height, int width)
+{
+    crop.clear();
+    const TiledReader reader(filename);
+    return reader.read(crop, row, col, height, width);
+}
+
+// TiledReader -----------------------------------------------------------------
+
+TiledReader::TiledReader(const std::string& filename)
+{
+    open(filename);
+}
+
+bool TiledReader::open(const std::string& filename)
+{
+    close();
+    internal::TiledHeader header;
+    std::vector<internal::TiledEntry> index;
+    std::uint64_t size = 0;
+
+    auto mapping = std::make_shared<internal::MappedFile>(filename);
+    if(mapping->valid())
+    {
+        size = mapping->size();
+        if(size < sizeof(header)) return false;
+        std::memcpy(&header, mapping->data(), sizeof(header));
+    }
+    else
+    {
+        mapping.reset();
+        std::FILE* file = std::fopen(filename.c_str(), "rb");
+        if(file == nullptr) return false;
+        const bool ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+                        internal::size64(file, size);
+        std::fclose(file);
+        if(!ok) return false;
+    }
+
+    if(std::memcmp(header.magic, internal::tiled_magic, sizeof(header.magic)) != 0 ||
+       header.endian != internal::raw_endian ||
+       header.channels < 1 || header.channels > 4 ||
+       !internal::valid_raw_type(header.type) ||
+       header.tile == 0 || header.tile > std::uint32_t(INT_MAX) ||
+       std::uint64_t(header.tile) * header.tile * header.channels * (header.type & 0xFF) > std::uint64_t(INT_MAX) ||
+       header.height > std::uint32_t(INT_MAX) || header.width > std::uint32_t(INT_MAX) ||
+       std::uint64_t(header.height) * header.width * header.channels > std::uint64_t(INT_MAX))
+        return false;
+    const auto tile    = std::uint64_t(header.tile);
+    const auto tiles_x = (header.width  + tile - 1) / tile;
+    const auto tiles_y = (header.height + tile - 1) / tile;
+    const auto count   = tiles_x * tiles_y;
+    if(count > (size - sizeof(header)) / sizeof(internal::TiledEntry))
+        return false;
+
+    index.resize(std::size_t(count));
+    if(mapping)
+    {
+        if(count > 0)
+            std::memcpy(index.data(), mapping->data() + sizeof(header), index.size() * sizeof(internal::TiledEntry));
+    }
+    else if(count > 0)
+    {
+        std::FILE* file = std::fopen(filename.c_str(), "rb");
+        if(file == nullptr) return false;
+        const bool ok = internal::seek64(file, sizeof(header)) &&
+                        std::fread(index.data(), sizeof(internal::TiledEntry), index.size(), file) == index.size();
+        std::fclose(file);
+        if(!ok) return false;
+    }
+    for(const auto& entry : index)
+        if(entry.offset > size || entry.size > size - entry.offset || entry.size > std::uint64_t(INT_MAX))
+            return false;
+
+    m_filename = filename;
+    m_mapping  = std::move(mapping);
+    m_header   = header;
+    m_index    = std::move(index);
+    m_tiles_x  = int(tiles_x);
+    m_tiles_y  = int(tiles_y);
+    return true;
+}
+
+void TiledReader::close()
+{
+    m_filename.clear();
+    m_mapping.reset();
+    m_header = {};
+    m_index.clear();
+    m_tiles_x = 0;
+    m_tiles_y = 0;
+}
+
+bool TiledReader::is_open() const
+{
+    return m_header.tile != 0;
+}
+
+int TiledReader::height() const
+{
+    return int(m_header.height);
+}
+
+int TiledReader::width() const
+{
+    return int(m_header.width);
+}
+
+int TiledReader::channels() const
+{
+    return int(m_header.channels);
+}
+
+int TiledReader::tile() const
+{
+    return int(m_header.tile);
+}
+
+const unsigned char* TiledReader::tile_bytes(int k, std::FILE* file, std::vector<unsigned char>& buffer) const
+{
+    const auto& entry = m_index[k];
+    if(m_mapping)
+        return m_mapping->data() + entry.offset;
+    buffer.resize(std::size_t(entry.size));
+    if(!internal::seek64(file, entry.offset) ||
+       std::fread(buffer.data(), 1, buffer.size(), file) != buffer.size())
+        return nullptr;
+    return buffer.data();
+}
+
+template<typename T, int C>
+bool TiledReader::read(Image<T,C>& crop, int row, int col, int height, int width) const
+{
+    crop.clear();
+    if(!is_open() ||
+       m_header.channels != std::uint32_t(C) ||
+       m_header.type != internal::raw_type<T>() ||
+       row < 0 || col < 0 || height < 0 || width < 0 ||
+       row > this->height() - height || col > this->width() - width)
+        return false;
+    crop.resize(height, width);
+    if(height == 0 || width == 0)
+        return true;
+
+    const int tile = this->tile();
+    const int tx0  = col / tile;
+    const int ty0  = row / tile;
+    const int tx1  = (col + width  - 1) / tile;
+    const int ty1  = (row + height - 1) / tile;
+    const int columns = tx1 - tx0 + 1;
+    const int count   = columns * (ty1 - ty0 + 1);
+
+    std::atomic<bool> failed{false};
+    internal::parallel_for(0, count, 1, [&](int first, int last)
+    {
+        std::FILE* file = nullptr;
+        if(!m_mapping && (file = std::fopen(m_filename.c_str(), "rb")) == nullptr)
+        {
+            failed = true;
+            return;
+        }
+        std::vector<unsigned char> compressed;
+        std::vector<T>             pixels;
+        for(int n = first; n < last && !failed; ++n)
+        {
+            const int tx = tx0 + n % columns;
+            const int ty = ty0 + n / columns;
+            const int k  = ty * m_tiles_x + tx;
+            const int i0 = ty * tile;
+            const int j0 = tx * tile;
+            const int h  = std::min(tile, this->height() - i0);
+            const int w  = std::min(tile, this->width()  - j0);
+            pixels.resize(std::size_t(h) * w * C);
+
+            const auto bytes = tile_bytes(k, file, compressed);
+            const int  size  = int(pixels.size() * sizeof(T));
+            if(bytes == nullptr ||
+               stb::stbi_zlib_decode_buffer(reinterpret_cast<char*>(pixels.data()), size,
+                                            reinterpret_cast<const char*>(bytes), int(m_index[k].size)) != size)
+            {
+                failed = true;
+                break;
+            }
+
+            // overlap of the tile and the rectangle
+            const int i_first = std::max(i0, row);
+            const int i_last  = std::min(i0 + h, row + height);
+            const int j_first = std::max(j0, col);
+            const int j_last  = std::min(j0 + w, col + width);
+            for(int i = i_first; i < i_last; ++i)
+                std::memcpy(crop.raw() + (std::size_t(i - row) * width + (j_first - col)) * C,
+                            pixels.data() + (std::size_t(i - i0) * w + (j_first - j0)) * C,
+                            std::size_t(j_last - j_first) * C * sizeof(T));
+        }
+        if(file)
+            std::fclose(file);
+    });
+
+    if(failed)
+        crop.clear();
+    return !failed;
+}
+
+template<typename T, int C>
+bool TiledReader::read(Image<T,C>& image) const
+{
+    return read(image, 0, 0, height(), width());
+}
+
+} // namespace img